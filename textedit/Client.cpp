@@ -145,6 +145,13 @@ void Client::messageHandler(MessageCapsule message)
 	case ListEdit:
 		handleListEdit(message);
 		break;
+	case DocumentReady:
+	{
+		// The server renumbered the document positions (new epoch), replace the local copy
+		DocumentReadyMessage* documentReady = dynamic_cast<DocumentReadyMessage*>(message.get());
+		emit documentResync(documentReady->getDocument());
+		break;
+	}
 	case Failure:
 		disconnect(socket, &QSslSocket::readyRead, this, &Client::readBuffer);
 		emit documentForceClose();
@@ -672,33 +679,33 @@ void Client::handleCursor(MessageCapsule message)
 
 /* Send messages to server */
 
-void Client::sendCharsInsert(QVector<Symbol> symbols, bool isLast, TextBlockID bId, QTextBlockFormat blkFmt)
+void Client::sendCharsInsert(QVector<Symbol> symbols, QVector<QTextCharFormat> charFmts, bool isLast, TextBlockID bId, QTextBlockFormat blkFmt, quint32 epoch)
 {
 	try
 	{
-		MessageFactory::CharsInsert(symbols, isLast, bId, blkFmt)->send(socket);
+		MessageFactory::CharsInsert(symbols, charFmts, isLast, bId, blkFmt, epoch)->send(socket);
 	}
 	catch (MessageException & me) {
 		qDebug() << me.what();
 	}
 }
 
-void Client::sendCharsDelete(QVector<Position> positions)
+void Client::sendCharsDelete(QVector<Position> positions, quint32 epoch)
 {
 	try
 	{
-		MessageFactory::CharsDelete(positions)->send(socket);
+		MessageFactory::CharsDelete(positions, epoch)->send(socket);
 	}
 	catch (MessageException & me) {
 		qDebug() << me.what();
 	}
 }
 
-void Client::sendCharsFormat(QVector<Position> positions, QVector<QTextCharFormat> fmts)
+void Client::sendCharsFormat(QVector<Position> positions, QVector<QTextCharFormat> fmts, quint32 epoch)
 {
 	try 
 	{
-		MessageFactory::CharsFormat(positions, fmts)->send(socket);
+		MessageFactory::CharsFormat(positions, fmts, epoch)->send(socket);
 	}
 	catch (MessageException& me) {
 		qDebug() << me.what();
@@ -733,7 +740,7 @@ void Client::sendListEdit(TextBlockID blockId, TextListID listId, QTextListForma
 void Client::handleCharsInsert(MessageCapsule message)
 {
 	CharsInsertMessage* bulkInsertMsg = dynamic_cast<CharsInsertMessage*>(message.get());
-	emit insertSymbols(bulkInsertMsg->getSymbols(), bulkInsertMsg->getIsLast(),
+	emit insertSymbols(bulkInsertMsg->getSymbols(), bulkInsertMsg->getCharFormats(), bulkInsertMsg->getIsLast(),
 		bulkInsertMsg->getBlockId(), bulkInsertMsg->getBlockFormat());
 }
 
@@ -89,9 +89,9 @@ public slots:
 
 	// Send TextEditor messages to server
 	void sendCursor(qint32 userId, qint32 position);
-	void sendCharsInsert(QVector<Symbol> symbols, bool isLast, TextBlockID bId, QTextBlockFormat blkFmt);
-	void sendCharsDelete(QVector<Position> positions);
-	void sendCharsFormat(QVector<Position> positions, QVector<QTextCharFormat> fmts);
+	void sendCharsInsert(QVector<Symbol> symbols, QVector<QTextCharFormat> charFmts, bool isLast, TextBlockID bId, QTextBlockFormat blkFmt, quint32 epoch);
+	void sendCharsDelete(QVector<Position> positions, quint32 epoch);
+	void sendCharsFormat(QVector<Position> positions, QVector<QTextCharFormat> fmts, quint32 epoch);
 	void sendBlockFormat(TextBlockID blockId, QTextBlockFormat fmt);
 	void sendListEdit(TextBlockID blockId, TextListID listId, QTextListFormat fmt);
 
@@ -122,10 +122,11 @@ signals:
 	void documentDismissed(URI URI);
 	void documentExitComplete();
 	void documentForceClose();
+	void documentResync(Document document);
 	void documentExitFailed(QString errorType);
 	
 	// TextEdit Signals
-	void insertSymbols(QVector<Symbol> symbols, bool isLast, TextBlockID bId, QTextBlockFormat blkFmt);
+	void insertSymbols(QVector<Symbol> symbols, QVector<QTextCharFormat> charFmts, bool isLast, TextBlockID bId, QTextBlockFormat blkFmt);
 	void removeSymbols(QVector<Position> positions);
 	void formatSymbols(QVector<Position> positions, QVector<QTextCharFormat> fmts);
 	void formatBlock(TextBlockID blockId, QTextBlockFormat fmt);
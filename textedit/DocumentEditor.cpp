@@ -20,32 +20,57 @@ DocumentEditor::DocumentEditor(Document doc, TextEdit* editor, User& user, QObje
 
 
 void DocumentEditor::openDocument()
+{
+	loadContents();
+
+	_textedit->setCurrentFileName(_document.getName(), _document.getURI().toString());
+	_textedit->startTimers();
+}
+
+void DocumentEditor::resyncDocument(Document doc)
+{
+	bool sameContents = doc.hasSameContents(_document);
+	int oldLength = _document.length();
+
+	_document = doc;
+
+	if (!sameContents)
+	{
+		// Some local edits (of the chars or of their formats) were discarded by the server (based on the positions
+		// of the previous epoch), show again the contents of the document as they are on the server
+		_textedit->removeChars(0, oldLength);
+		loadContents();
+	}
+}
+
+void DocumentEditor::loadContents()
 {
 	// Insert all symbols in the document
-	QVector<Symbol>::iterator s = _document._text.begin();
+	const SymbolSequence& text = _document._text;		// (const iterators, which only read the chunks)
+	SymbolSequence::const_iterator s = text.begin();
 	QString buffer;
 	int position = 0;
-	QTextCharFormat oldFmt;
+	qint32 oldFmt = CHARFORMAT_DEFAULT;
 
-	for (; s < _document._text.end() - 1; s++)
+	for (; s < text.end() - 1; s++)
 	{
-		if (oldFmt == s->getFormat())
+		if (oldFmt == s->getFormatIndex())
 		{
 			buffer.append(s->getChar());
 		}
 		else
 		{
-			_textedit->newChars(buffer, oldFmt, position);
+			_textedit->newChars(buffer, _document.getCharFormat(oldFmt), position);
 			position += buffer.length();
 			buffer.clear();
 			buffer.append(s->getChar());
-			oldFmt = s->getFormat();
+			oldFmt = s->getFormatIndex();
 		}
 	}
 
 	if (!buffer.isEmpty())
 	{	// Insert the last chunk of characters
-		_textedit->newChars(buffer, oldFmt, position);
+		_textedit->newChars(buffer, _document.getCharFormat(oldFmt), position);
 	}
 
 
@@ -67,67 +92,52 @@ void DocumentEditor::openDocument()
 	foreach(TextBlock block, _document._blocks.values()) {
 		_textedit->applyBlockFormat(_document.getBlockPosition(block.getId()), block.getFormat());
 	}
-
-	_textedit->setCurrentFileName(_document.getName(), _document.getURI().toString());
-	_textedit->startTimers();
 }
 
 
 /************ CHAR OPERATIONS ************/
 
-void DocumentEditor::charsInsert(QVector<Symbol> symbols, bool isLast, TextBlockID bId, QTextBlockFormat blkFmt)
+void DocumentEditor::charsInsert(QVector<Symbol> symbols, QVector<QTextCharFormat> charFmts, bool isLast, TextBlockID bId, QTextBlockFormat blkFmt)
 {
-	QString buffer;
-	QVector<Symbol>::iterator s = symbols.begin();
-	int start = -1;
-	int position = -2;
-	QTextCharFormat curFmt;
+	int skip = -1;
 
-	for (; s < symbols.end() - 1; s++)
-	{
-		int index = _document.insert(*s, position + 1);
-		if (index == position + 1 && curFmt == s->getFormat())
-		{
-			// Extend the current chunk of symbols to be inserted at once
-			buffer.append(s->getChar());
-			position = index;
-		}
-		else
-		{
-			// Insert the accumulated chars all at once
-			if (start >= 0)
-				_textedit->newChars(buffer, curFmt, start);
+	_document.importCharFormats(symbols, charFmts);		// (map the symbol formats to the document's pool)
 
-			// Begin a new batch of symbols to insert
-			buffer.clear();
-			buffer.append(s->getChar());
-			curFmt = s->getFormat();
-			start = position = index;
-		}
+	// Merge the whole batch in the document
+	Position terminator = symbols.isEmpty() ? Position() : symbols.last().getPosition();
+	QList<QPair<int, int>> ranges = _document.insertRange(symbols);
+
+	if (isLast && !symbols.isEmpty())
+	{	// skip inserting the terminating char in the Qt document
+		skip = _document.findPosition(terminator);
 	}
 
-	if (s < symbols.end())	// Handle the last symbol separately (to avoid checking isLast at every iteration)
+	// Insert in the Qt document a chunk of chars with the same format
+	auto insertChunk = [this](int from, int to, qint32 fmt) {
+		if (to > from)
+			_textedit->newChars(_document._text.text(from, to - from), _document.getCharFormat(fmt), from);
+	};
+
+	const SymbolSequence& text = _document._text;
+	for (const QPair<int, int>& range : ranges)
 	{
-		int position = _document.insert(*s);
-		if (!isLast)
-		{	// skip inserting the terminating char in the Qt document
-			if (position == position + 1 && s->getFormat() == curFmt)
-			{
-				buffer.append(s->getChar());
-				_textedit->newChars(buffer, curFmt, start);
-			}
-			else
-			{
-				if (!buffer.isEmpty())
-					_textedit->newChars(buffer, curFmt, start);
+		SymbolSequence::const_iterator s = text.begin() + range.first;
+		int end = range.first + range.second;
+		int start = range.first;
+		qint32 curFmt = s->getFormatIndex();
 
-				_textedit->newChars(s->getChar(), s->getFormat(), position);
-			}
-		}
-		else if (!buffer.isEmpty())
+		for (int i = range.first; i < end; i++, s++)
 		{
-			_textedit->newChars(buffer, curFmt, start);
+			if (i == skip || s->getFormatIndex() != curFmt)
+			{
+				// Insert the accumulated chars all at once and begin a new chunk
+				insertChunk(start, i, curFmt);
+				start = (i == skip ? i + 1 : i);
+				curFmt = s->getFormatIndex();
+			}
 		}
+
+		insertChunk(start, end, curFmt);
 	}
 
 	// Apply the block format received with the CharsInsert message
@@ -139,35 +149,10 @@ void DocumentEditor::charsInsert(QVector<Symbol> symbols, bool isLast, TextBlock
 
 void DocumentEditor::charsDelete(QVector<Position> positions)
 {
-	int position = -1;
-	int count = 0;
-
-	for each (Position fPos in positions)
+	// Delete the symbols from the document, and then each contiguous range of chars from the editor
+	foreach(const QPair<int, int>& range, _document.removeRange(positions))
 	{
-		int index = _document.remove(fPos, position);
-
-		if (index >= 0)	  // Skip non-extisting characters
-		{
-			if (index == position)
-			{	// Keep extending the chunk of symbols to format at once
-				count++;
-			}
-			else
-			{
-				// Delete all chars in the current range
-				if (position >= 0 && count > 0)
-					_textedit->removeChars(position, position + count);
-
-				// Begin a new batch of symbols to delete
-				position = index;
-				count = 1;
-			}
-		}
-	}
-
-	if (position >= 0 && count > 0)
-	{	// Delete the last chunk of characters
-		_textedit->removeChars(position, position + count);
+		_textedit->removeChars(range.first, range.first + range.second);
 	}
 }
 
@@ -175,60 +160,65 @@ void DocumentEditor::addCharsAtIndex(QVector<QChar> chars, QVector<QTextCharForm
 	int pos, bool isLast, QTextBlockFormat blkFmt)
 {
 	QVector<Symbol> symbols;
-	QVector<QChar>::iterator i = chars.begin();
-	QVector<QTextCharFormat>::iterator j = fmts.begin();
-	int positionHint = -1;
+	int count = std::min(chars.size(), fmts.size());
 
-	// Add all the provided chars to the document as symbols and to the list
-	// of symbols that will have to be inserted by other clients
-	for (int n = 0; i < chars.end() && j < fmts.end(); i++, j++, n++)
-	{
-		Symbol s(*i, *j, _document.newFractionalPos(pos + n, _user.getUserId()));
+	// Allocate the positions of all the new chars at once, in the gap at the insertion index
+	QVector<Position> positions = _document.newFractionalPositions(pos, count, _user.getUserId());
+	symbols.reserve(count);
 
-		// Insert the symbol in the document (locally)
-		positionHint = _document.insert(s, positionHint);
-		symbols.append(s);
+	// Build the symbols to be added to the document and to be inserted by other clients
+	for (int n = 0; n < count; n++)
+	{
+		symbols.append(Symbol(chars[n], _document.internCharFormat(fmts[n]), positions[n]));
 	}
 
+	_document.insertRange(symbols);		// Insert the symbols in the document (locally)
+
 	TextBlockID blkId = _document.getBlockAt(pos);		// Format the block with the provided QTextBlockFormat
 	_document.formatBlock(blkId, blkFmt);
+
+	// The symbols sent to the server only refer to the formats carried by the message
+	QVector<QTextCharFormat> charFmts = _document.exportCharFormats(symbols);
 	
-	emit charsAdded(symbols, isLast, blkId, blkFmt);
+	emit charsAdded(symbols, charFmts, isLast, blkId, blkFmt, _document.getEpoch());
 }
 
 void DocumentEditor::deleteCharsAtIndex(int position, int charCount)
 {
 	QVector<Position> fPositions;
+	const SymbolSequence& text = _document._text;
+	SymbolSequence::const_iterator s = text.begin() + position;
 
-	for (int i = 0; i < charCount && position < _document.length(); i++)
+	// Collect the fractional positions of the symbols, which need to be removed by other clients
+	for (int i = 0; i < charCount && s < text.end(); i++, s++)
 	{
-		// Delete the symbols one by one from the document, inserting their fractional positions
-		// in the list of those that need to be removed by other clients
-		fPositions.append(_document.removeAtIndex(position));
+		fPositions.append(s->getPosition());
 	}
 
-	emit charsDeleted(fPositions);
+	_document.removeRange(position, fPositions.size());		// Delete all the symbols from the document at once
+
+	emit charsDeleted(fPositions, _document.getEpoch());
 }
 
 
 void DocumentEditor::changeSymbolFormat(int position, int count, QVector<QTextCharFormat> fmts)		// LOCAL
 {
 	QVector<Position> positions;
-	QVector<Symbol>::iterator s = _document._text.begin() + position;
+	SymbolSequence::iterator s = _document._text.begin() + position;
 
 	// Apply the format change locally and build the array to be sent to the server
 	for (int i = 0; i < count && s != _document._text.end(); i++, s++)
 	{
-		s->setFormat(fmts[i]);
+		s->setFormatIndex(_document.internCharFormat(fmts[i]));
 		positions.append(s->getPosition());
 	}
 
-	emit charsFormatChanged(positions, fmts);
+	emit charsFormatChanged(positions, fmts, _document.getEpoch());
 }
 
 void DocumentEditor::applySymbolFormat(QVector<Position> positions, QVector<QTextCharFormat> fmts)		// REMOTE
 {
-	QTextCharFormat curFmt;
+	qint32 curFmt = CHARFORMAT_DEFAULT;
 	int start = -1;
 	int index = -2;
 	int count = 0;
@@ -239,7 +229,9 @@ void DocumentEditor::applySymbolFormat(QVector<Position> positions, QVector<QTex
 
 		if (index >= 0)	  // Skip non-extisting characters
 		{
-			if (index == start + count && fmts[i] == curFmt)	
+			qint32 fmt = _document[index].getFormatIndex();		// (interned by formatSymbol)
+
+			if (index == start + count && fmt == curFmt)	
 			{	// Keep extending the chunk of symbols to format at once
 				count++;
 			}
@@ -247,19 +239,19 @@ void DocumentEditor::applySymbolFormat(QVector<Position> positions, QVector<QTex
 			{
 				// Apply the current format to all chars in the range
 				if (start >= 0 && count > 0)
-					_textedit->applyCharFormat(start, start + count, curFmt);
+					_textedit->applyCharFormat(start, start + count, _document.getCharFormat(curFmt));
 
 				// Begin a new batch of symbols to format
 				start = index;
 				count = 1;
-				curFmt = fmts[i];
+				curFmt = fmt;
 			}
 		}
 	}
 
 	if (start >= 0 && count > 0)
 	{	// Apply the last chunk of charFormats
-		_textedit->applyCharFormat(start, start + count, curFmt);
+		_textedit->applyCharFormat(start, start + count, _document.getCharFormat(curFmt));
 	}
 }
 
@@ -269,26 +261,17 @@ void DocumentEditor::applySymbolFormat(QVector<Position> positions, QVector<QTex
 void DocumentEditor::generateExtraSelection()
 {
 	if (_document.length() > 0) {
-		QPair<int, int> selectionDelimiters;
+		int end = _document.length() - 1;		// (the last paragraph separator is excluded)
+		int start = 0;
 
-		//Get firs character author
-		qint32 userId = _document[0].getAuthorId();
-		selectionDelimiters.first = 0;
-		selectionDelimiters.second = 0;
-
-		//Increment selection upper limit until we reach end of document or a char inserted by another user
-		for (int i = 0; i < _document.length() -1; i++) {
-			if (_document[i].getAuthorId() != userId) {
-				_textedit->setExtraSelections(userId, selectionDelimiters);
-
-				userId = _document[i].getAuthorId();
-				selectionDelimiters.first = i;
-				selectionDelimiters.second = i;
-			}
-			selectionDelimiters.second++;
-		}
+		//Extend each selection until we reach end of document or a char inserted by another user
+		do {
+			qint32 userId = _document[start].getAuthorId();
+			int next = _document._text.nextAuthorChange(start, end);
 
-		_textedit->setExtraSelections(userId, selectionDelimiters);
+			_textedit->setExtraSelections(userId, QPair<int, int>(start, next));
+			start = next;
+		} while (start < end);
 	}
 }
 
@@ -22,10 +22,16 @@ public:
 	DocumentEditor(Document doc, TextEdit* editor, User& user, QObject* parent = nullptr);
 	void openDocument();
 
+private:
+
+	void loadContents();		// fills the editor with the contents of the document
+
 public slots:
 
+	void resyncDocument(Document doc);		// (after the server compacted the document positions)
+
 	// Char operations
-	void charsInsert(QVector<Symbol> symbols, bool isLast, TextBlockID bId, QTextBlockFormat blkFmt);
+	void charsInsert(QVector<Symbol> symbols, QVector<QTextCharFormat> charFmts, bool isLast, TextBlockID bId, QTextBlockFormat blkFmt);
 	void charsDelete(QVector<Position> positions);
 	void addCharsAtIndex(QVector<QChar> chars, QVector<QTextCharFormat> fmts, int pos, bool isLast, QTextBlockFormat blkFmt);
 	void deleteCharsAtIndex(int position, int charCount);
@@ -50,9 +56,9 @@ public slots:
 
 signals:
 
-	void charsAdded(QVector<Symbol> symbols, bool isLast, TextBlockID bId, QTextBlockFormat blkFmt);
-	void charsDeleted(QVector<Position> positions);
-	void charsFormatChanged(QVector<Position> positions, QVector<QTextCharFormat> fmts);
+	void charsAdded(QVector<Symbol> symbols, QVector<QTextCharFormat> charFmts, bool isLast, TextBlockID bId, QTextBlockFormat blkFmt, quint32 epoch);
+	void charsDeleted(QVector<Position> positions, quint32 epoch);
+	void charsFormatChanged(QVector<Position> positions, QVector<QTextCharFormat> fmts, quint32 epoch);
 	void blockFormatChanged(TextBlockID blockId, QTextBlockFormat fmt);
 	void blockListChanged(TextBlockID blockId, TextListID listId, QTextListFormat fmt);
 };
@@ -190,6 +190,7 @@ void LiveText::openDocumentCompleted(Document doc)
 	connect(_client, &Client::formatBlock, _docEditor, &DocumentEditor::applyBlockFormat, Qt::QueuedConnection);
 	connect(_client, &Client::formatSymbols, _docEditor, &DocumentEditor::applySymbolFormat, Qt::QueuedConnection);
 	connect(_client, &Client::listEditBlock, _docEditor, &DocumentEditor::listEditBlock, Qt::QueuedConnection);
+	connect(_client, &Client::documentResync, _docEditor, &DocumentEditor::resyncDocument, Qt::QueuedConnection);
 
 
 	//If opening document is not present in user data, it updates data
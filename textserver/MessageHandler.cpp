@@ -139,7 +139,7 @@ void MessageHandler::process(MessageCapsule message, QSslSocket* socket)
 	case CharsInsert:
 	{
 		CharsInsertMessage* blkInsertMsg = dynamic_cast<CharsInsertMessage*>(message.get());
-		emit charsInsert(blkInsertMsg->getSymbols(), blkInsertMsg->getBlockId(), blkInsertMsg->getBlockFormat());
+		emit charsInsert(blkInsertMsg->getSymbols(), blkInsertMsg->getCharFormats(), blkInsertMsg->getBlockId(), blkInsertMsg->getBlockFormat());
 		emit messageDispatch(message, socket);
 		break;
 	}
@@ -47,7 +47,7 @@ signals:
 	MessageCapsule documentOpen(QSslSocket* lientSocket, URI docUri, bool docJustCreated = false);
 	MessageCapsule documentRemove(QSslSocket* lientSocket, URI docUri);
 
-	void charsInsert(QVector<Symbol> syms, TextBlockID bId, QTextBlockFormat blkFmt);
+	void charsInsert(QVector<Symbol> syms, QVector<QTextCharFormat> charFmts, TextBlockID bId, QTextBlockFormat blkFmt);
 	void charsDelete(QVector<Position> poss);
 	void charsFormat(QVector<Position> pos, QVector<QTextCharFormat> fmts);
 	void blockEdit(TextBlockID id, QTextBlockFormat fmt);
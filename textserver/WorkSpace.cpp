@@ -2,22 +2,36 @@
 
 #include <QCoreApplication>
 
+#include <algorithm>
+
 #include "ServerLogger.h"
 #include <MessageFactory.h>
 #include <SharedException.h>
 #include "SocketBuffer.h"
+#include <DocumentMessage.h>
+#include <TextEditMessage.h>
 
 
 WorkSpace::WorkSpace(QSharedPointer<Document> d, QObject* parent)
-	: doc(d), messageHandler(this), nFails(0)
+	: doc(d), messageHandler(this), nFails(0), saveThread(nullptr)
 {
 	Logger() << "Loading document " << doc->getURI().toString();
 
 	// Load the document contents
 	doc->load();
+	doc->setLazyRemoval(true);		// (deleted symbols are reclaimed while the document is idle)
+	doc->setPositionIndex(true);	// (remote edits locate their symbols by position)
+	doc->setEditThreads(QThread::idealThreadCount());		// (edits to distant parts of the document are applied in parallel)
+	doc->setCompression(DOCUMENT_COMPRESSION);			// (applies to the pages written by the following saves)
+	journal.open(doc->getJournalName());		// (the applied edits are appended to it, until the next checkpoint)
 
 	Logger() << "(LOAD COMPLETED)";
 
+	// No client holds any position yet, compact them now if they have grown too deep
+	if (needsCompaction())
+		documentCompact();
+	idleTimer.start();
+
 	// Start the auto-save timer
 	timer.callOnTimeout<WorkSpace*>(this, &WorkSpace::documentSave);
 	timer.start(DOCUMENT_SAVE_TIMEOUT);
@@ -34,12 +48,22 @@ WorkSpace::~WorkSpace()
 	timer.stop();			// Stop timer which is periodically saving the doc
 	workThread->quit();		// Quit the thread
 	workThread->wait();		// Waiting for ending the thread
+	documentApplyEdits();	// Apply the last edits received
+	journal.close();		// (commits the last records)
+
+	if (saveThread)
+	{
+		saveThread->wait();		// Let the last background save complete, before the final one
+		delete saveThread;
+	}
 
 	Logger() << "Saving and unloading document " << doc->getURI().toString();
 
 	try
 	{
-		doc->save();			// Saving changes to the document before closing the workspace
+		doc->beginJournal();		// Saving changes to the document before closing the workspace,
+		doc->save();				// as a checkpoint which replaces all the journals
+		doc->removeOldJournals();
 		doc->unload();			// Unload the document contents from memory until it gets re-opened
 
 		Logger() << "(COMPLETED)";
@@ -65,6 +89,7 @@ void WorkSpace::newClient(QSharedPointer<Client> client)
 	connect(socket, &QSslSocket::disconnected, this, &WorkSpace::clientDisconnection);
 	connect(socket, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error), this, &WorkSpace::socketErr);
 
+	documentApplyEdits();
 	MessageFactory::DocumentReady(*doc)->send(socket);		// Send the document to the client
 
 	// Send to the new user all the Presence messages of other editors in the workspace
@@ -118,7 +143,12 @@ void WorkSpace::readMessage()
 			message->read(dataStream);
 			socketBuffer.clearBuffer();
 
-			if (mType == AccountUpdate || (mType >= CharsInsert && mType <= PresenceRemove) || mType == DocumentClose)
+			if (isStaleEdit(message))
+			{
+				// The client will replace its document with the compacted one, which it has already been sent
+				Logger() << "(STALE EPOCH) Discarded " << Message::TypeName(mType) << " based on outdated positions";
+			}
+			else if (mType == AccountUpdate || (mType >= CharsInsert && mType <= PresenceRemove) || mType == DocumentClose)
 			{
 				messageHandler.process(message, socket);
 			}
@@ -203,25 +233,77 @@ void WorkSpace::socketErr(QAbstractSocket::SocketError socketError)
 
 /****************************** DOCUMENT METHODS ******************************/
 
-/* Save document, if something goes wrong throw exception after MAX_FAILS */
+/* Once the journal has grown past its limit, save a snapshot of the document in the background (checkpoint),
+   the result is handled by documentSaved() */
 void WorkSpace::documentSave()
 {
 	if (editors.size() == 0)	// Skip saving if all clients have already quit
 		return;					// (Workspace will save the document before closing anyways)
 
-	try
+	if (saveThread)				// Skip saving if the previous snapshot is still being written
+		return;
+
+	documentApplyEdits();
+
+	if (idleTimer.hasExpired(DOCUMENT_COMPACT_IDLE))
 	{
-		// Save the document's contents to file
-		Logger() << "Saving document " << doc->getURI().toString();
-		doc->save();
+		// Reclaim the deleted symbols, renumber the positions (if they have grown too deep) and pack the text
+		// of a document which is not being edited
+		doc->purgeTombstones();
+		if (needsCompaction())
+			documentCompact();
+
+		doc->packText();
+	}
+
+	if (journal.size() < DOCUMENT_JOURNAL_LIMIT)		// (until then, the edits are only appended to the journal)
+		return;
+
+	// The following edits go to a new journal, the previous ones are deleted once the snapshot is saved
+	journalCommit();
+	doc->beginJournal();
+	journal.open(doc->getJournalName());
 
+	// Freeze the document's contents, and write them to file while the edits go on in this thread
+	Logger() << "Saving document " << doc->getURI().toString();
+	QSharedPointer<Document> snapshot(new Document(doc->snapshot()));
+	saveError.clear();
+
+	saveThread = QThread::create([this, snapshot]() {
+		try
+		{
+			snapshot->save();
+			snapshot->removeOldJournals();
+			saveDepth = snapshot->getPositionDepth();
+		}
+		catch (DocumentException& de)
+		{
+			saveError = de.what();
+		}
+	});
+
+	connect(saveThread, &QThread::finished, this, &WorkSpace::documentSaved);
+	saveThread->start();
+}
+
+/* Check the outcome of the background save, if something went wrong close the workspace after MAX_FAILS */
+void WorkSpace::documentSaved()
+{
+	saveThread->deleteLater();
+	saveThread = nullptr;
+
+	if (saveError.isEmpty())
+	{
 		Logger() << "(SAVE COMPLETED)";
 		nFails = 0;
+
+		// Telemetry of the fractional position allocation
+		Logger() << "Position depth: average " << saveDepth.first << ", max " << saveDepth.second;
 	}
-	catch (DocumentException& de)
+	else
 	{
 		nFails++;
-		Logger(Error) << de.what() << ", fail count = " << nFails;
+		Logger(Error) << qUtf8Printable(saveError) << ", fail count = " << nFails;
 		if (nFails >= DOCUMENT_MAX_FAILS) {
 			// Send Failure message to all clients in the workspace
 			for each (QSslSocket * client in editors.keys())
@@ -230,46 +312,142 @@ void WorkSpace::documentSave()
 	}
 }
 
-void WorkSpace::documentInsertSymbols(QVector<Symbol> symbols, TextBlockID blockId, QTextBlockFormat blockFmt)
+/* Renumber the positions of the document (new epoch), and send the compacted document to the clients */
+void WorkSpace::documentCompact()
+{
+	Logger() << "Compacting the positions of document " << doc->getURI().toString();
+	documentApplyEdits();
+	doc->compactPositions();
+	journalRecord().recordCompaction();
+
+	Logger() << "(COMPACTION COMPLETED) epoch " << doc->getEpoch();
+
+	// The clients still hold the positions of the previous epoch and need to re-sync; the socket
+	// order guarantees that any edit they send after receiving the new document is based on it
+	for (auto target = editors.keyBegin(); target != editors.keyEnd(); ++target)
+	{
+		MessageFactory::DocumentReady(*doc)->send(*target);
+	}
+}
+
+/* Apply all the queued edits as a batch, in which the ones to different segments of the document run in parallel */
+void WorkSpace::documentApplyEdits()
+{
+	if (pendingEdits.isEmpty())
+		return;
+
+	doc->applyEdits(pendingEdits);
+	pendingEdits.clear();
+}
+
+/* Write the records of the edits received in this round of the event loop to the journal, with a single sync */
+void WorkSpace::journalCommit()
+{
+	if (journal.hasPending() && !journal.commit())
+		Logger(Error) << "Cannot write the journal of document " << doc->getURI().toString();
+}
+
+DocumentJournal& WorkSpace::journalRecord()
+{
+	if (!journal.hasPending())
+		QTimer::singleShot(0, this, &WorkSpace::journalCommit);
+
+	return journal;
+}
+
+void WorkSpace::queueEdit(const SymbolEdit& edit)
+{
+	// The batch is applied once the messages already received have been processed, or before the document is read
+	if (pendingEdits.isEmpty())
+		QTimer::singleShot(0, this, &WorkSpace::documentApplyEdits);
+
+	pendingEdits.append(edit);
+}
+
+bool WorkSpace::needsCompaction() const
+{
+	return doc->getPositionDepth().first >= DOCUMENT_COMPACT_DEPTH;
+}
+
+bool WorkSpace::isStaleEdit(MessageCapsule message) const
 {
-	int hint = -1;
+	quint32 epoch;
 
-	for each (Symbol symbol in symbols)
+	switch (message->getType())
 	{
-		hint = doc->insert(symbol, hint) + 1;
+	case CharsInsert:
+		epoch = dynamic_cast<CharsInsertMessage*>(message.get())->getEpoch();
+		break;
+	case CharsDelete:
+		epoch = dynamic_cast<CharsDeleteMessage*>(message.get())->getEpoch();
+		break;
+	case CharsFormat:
+		epoch = dynamic_cast<CharsFormatMessage*>(message.get())->getEpoch();
+		break;
+	default:
+		return false;		// (the other messages do not carry positions)
 	}
 
+	return epoch != doc->getEpoch();
+}
+
+void WorkSpace::documentInsertSymbols(QVector<Symbol> symbols, QVector<QTextCharFormat> charFmts, TextBlockID blockId, QTextBlockFormat blockFmt)
+{
+	idleTimer.restart();
+	journalRecord().recordInsert(symbols, charFmts, blockId, blockFmt);
+	doc->importCharFormats(symbols, charFmts);		// (map the symbol formats to the document's pool)
+
+	// Symbols are queued in position order, so that new blocks are created as by Document::insertRange
+	std::sort(symbols.begin(), symbols.end(),
+		[](const Symbol& a, const Symbol& b) { return a.getPosition().compare(b.getPosition()) < 0; });
+
+	for (const Symbol& s : symbols)
+		queueEdit({ SymbolEdit::Insertion, s });
+
 	if (blockId)
+	{
+		documentApplyEdits();
 		doc->formatBlock(blockId, blockFmt);
+	}
 }
 
 void WorkSpace::documentDeleteSymbols(QVector<Position> positions)
 {
-	int hint = -1;
+	idleTimer.restart();
+	journalRecord().recordDelete(positions);
 
-	for each (Position position in positions)
+	if (positions.size() > 1)
 	{
-		hint = doc->remove(position, hint);
+		// The blocks of a deleted selection are updated at once, after the edits which precede it
+		documentApplyEdits();
+		doc->removeRange(positions);
 	}
+	else for (const Position& fPos : positions)
+		queueEdit({ SymbolEdit::Removal, Symbol(QChar(), CHARFORMAT_DEFAULT, fPos) });
 }
 
 void WorkSpace::documentEditSymbols(QVector<Position> positions, QVector<QTextCharFormat> formats)
 {
-	int hint = -1;
+	idleTimer.restart();
+	journalRecord().recordFormat(positions, formats);
 
 	for (int i = 0; i < positions.length(); i++)
 	{
-		hint = doc->formatSymbol(positions[i], formats[i], hint);
+		queueEdit({ SymbolEdit::Formatting, Symbol(QChar(), doc->internCharFormat(formats[i]), positions[i]) });
 	}
 }
 
 void WorkSpace::documentEditBlock(TextBlockID blockId, QTextBlockFormat format)
 {
+	journalRecord().recordBlockEdit(blockId, format);
+	documentApplyEdits();
 	doc->formatBlock(blockId, format);
 }
 
 void WorkSpace::documentEditList(TextBlockID blockId, TextListID listId, QTextListFormat format)
 {
+	journalRecord().recordListEdit(blockId, listId, format);
+	documentApplyEdits();
 	doc->editBlockList(blockId, listId, format);
 }
 
@@ -2,15 +2,21 @@
 
 #include <QThread>
 #include <QTimer>
+#include <QElapsedTimer>
 #include <QSslSocket>
 
 #include <Document.h>
+#include <DocumentJournal.h>
 #include "Client.h"
 #include "MessageHandler.h"
 #include "ServerException.h"
 
-#define DOCUMENT_SAVE_TIMEOUT 30000		/* ms */
+#define DOCUMENT_SAVE_TIMEOUT 30000		/* ms between the checks of the journal size */
+#define DOCUMENT_JOURNAL_LIMIT 4194304	/* bytes of journal which trigger a checkpoint of the document */
 #define DOCUMENT_MAX_FAILS 3			/* #  */
+#define DOCUMENT_COMPACT_IDLE 60000		/* ms without edits before the positions can be compacted */
+#define DOCUMENT_COMPACT_DEPTH 6.0		/* average # of position levels which triggers a compaction */
+#define DOCUMENT_COMPRESSION 1			/* zlib level of the pages of the document files (0 = uncompressed) */
 
 
 class WorkSpace : public QObject
@@ -25,9 +31,22 @@ private:
 
 	QTimer timer;
 	quint16 nFails;
+	QElapsedTimer idleTimer;		// (restarted at every edit of the symbols)
+
+	QThread* saveThread;			// writes a snapshot of the document to file (only while the save is in progress)
+	QString saveError;				// (set by the save thread, read once it has finished)
+	QPair<double, int> saveDepth;	// (position depth telemetry, computed by the save thread on the snapshot)
+
+	QVector<SymbolEdit> pendingEdits;	// edits of the symbols received in this round of the event loop
+	DocumentJournal journal;			// edits applied after the last checkpoint (committed at the end of each round)
 
 	MessageHandler messageHandler;
 
+	bool needsCompaction() const;
+	bool isStaleEdit(MessageCapsule message) const;		// the message positions belong to an older epoch
+	void queueEdit(const SymbolEdit& edit);
+	DocumentJournal& journalRecord();		// (schedules the commit of the record which is going to be added)
+
 public:
 
 	WorkSpace(QSharedPointer<Document> d, QObject* parent = 0);
@@ -45,7 +64,11 @@ public slots:
 	void dispatchMessage(MessageCapsule message, QSslSocket* sender);
 	
 	void documentSave();
-	void documentInsertSymbols(QVector<Symbol> symbols, TextBlockID blockId, QTextBlockFormat blockFmt);
+	void documentSaved();
+	void documentCompact();
+	void documentApplyEdits();
+	void journalCommit();
+	void documentInsertSymbols(QVector<Symbol> symbols, QVector<QTextCharFormat> charFmts, TextBlockID blockId, QTextBlockFormat blockFmt);
 	void documentDeleteSymbols(QVector<Position> positions);
 	void documentEditSymbols(QVector<Position> positions, QVector<QTextCharFormat> formats);
 	void documentEditBlock(TextBlockID blockId, QTextBlockFormat format);
@@ -0,0 +1,104 @@
+#include "CharFormatPool.h"
+
+#include <QDataStream>
+
+
+/*************** CHARFORMATPOOL CLASS ***************/
+
+CharFormatPool::CharFormatPool()
+{
+	clear();
+}
+
+
+uint CharFormatPool::hash(const QTextCharFormat& fmt)
+{
+	// Only the attributes which commonly differ between formats are hashed: equal formats
+	// always have the same hash, and the (rare) collisions are solved by a full comparison
+	uint h = qHash(fmt.fontFamily());
+	h = h * 31 + qHash(fmt.fontPointSize());
+	h = h * 31 + uint(fmt.fontWeight());
+	h = h * 31 + uint(fmt.fontItalic()) * 2 + uint(fmt.fontUnderline());
+	h = h * 31 + uint(fmt.fontStrikeOut());
+	h = h * 31 + fmt.foreground().color().rgba();
+	h = h * 31 + fmt.background().color().rgba();
+
+	return h;
+}
+
+void CharFormatPool::rebuildLookup()
+{
+	_lookup.clear();
+	_lookup.reserve(_formats.size());
+
+	for (int i = 0; i < _formats.size(); i++)
+		_lookup.insert(hash(_formats[i]), i);
+}
+
+
+qint32 CharFormatPool::intern(const QTextCharFormat& fmt)
+{
+	uint h = hash(fmt);
+
+	for (QMultiHash<uint, qint32>::const_iterator i = _lookup.find(h); i != _lookup.end() && i.key() == h; ++i)
+	{
+		if (_formats[i.value()] == fmt)
+			return i.value();		// the format is already in the pool
+	}
+
+	// Add the new format at the end of the table
+	_formats.append(fmt);
+	_lookup.insert(h, _formats.size() - 1);
+
+	return _formats.size() - 1;
+}
+
+const QTextCharFormat& CharFormatPool::operator[](qint32 index) const
+{
+	Q_ASSERT(index >= 0 && index < _formats.size());
+	return _formats[index];
+}
+
+
+int CharFormatPool::size() const
+{
+	return _formats.size();
+}
+
+void CharFormatPool::clear()
+{
+	_formats.clear();
+	_formats.append(QTextCharFormat());		// (CHARFORMAT_DEFAULT)
+	rebuildLookup();
+}
+
+
+QVector<QTextCharFormat> CharFormatPool::toVector() const
+{
+	return _formats;
+}
+
+
+/*************** SERIALIZATION OPERATORS ***************/
+
+
+// CharFormatPool deserialization operator
+QDataStream& operator>>(QDataStream& in, CharFormatPool& pool)
+{
+	in >> pool._formats;
+
+	if (pool._formats.isEmpty())
+		pool._formats.append(QTextCharFormat());
+
+	pool.rebuildLookup();
+
+	return in;
+}
+
+// CharFormatPool serialization operator
+QDataStream& operator<<(QDataStream& out, const CharFormatPool& pool)
+{
+	out << pool._formats;
+
+	return out;
+}
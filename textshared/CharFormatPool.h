@@ -0,0 +1,40 @@
+#pragma once
+
+#include <QVector>
+#include <QMultiHash>
+#include <QTextCharFormat>
+
+#define CHARFORMAT_DEFAULT 0		// Index of the default QTextCharFormat, always present in a pool
+
+
+/************* CHARFORMATPOOL CLASS *************/
+
+/* Deduplicated table of the character formats used in a document: symbols only store the index
+   of their format in the pool, so that equal formats are shared and compared as integers */
+
+class CharFormatPool
+{
+	/* Operators for QDataStream serialization and deserialization */
+	friend QDataStream& operator>>(QDataStream& in, CharFormatPool& pool);			// Input
+	friend QDataStream& operator<<(QDataStream& out, const CharFormatPool& pool);	// Output
+
+private:
+
+	QVector<QTextCharFormat> _formats;
+	QMultiHash<uint, qint32> _lookup;		// hash of the most common attributes -> indexes of the formats
+
+	static uint hash(const QTextCharFormat& fmt);
+	void rebuildLookup();
+
+public:
+
+	CharFormatPool();		// Constructs a pool which only contains the default format
+
+	qint32 intern(const QTextCharFormat& fmt);		// returns the index of the format (adding it if needed)
+	const QTextCharFormat& operator[](qint32 index) const;
+
+	int size() const;
+	void clear();
+
+	QVector<QTextCharFormat> toVector() const;
+};
@@ -1,15 +1,80 @@
 #include "Document.h"
+#include "DocumentJournal.h"
 #include "SharedException.h"
 
 #include <algorithm>
+#include <climits>
 
 #include <QDataStream>
 #include <QMap>
+#include <QHash>
 #include <QDir>
+#include <QFileInfo>
+#include <QDebug>
 #include <QSaveFile>
+#include <QRandomGenerator>
 
 
 #define FPOS_GAP_SIZE 4						// Value used in the fractional position algorithm
+#define FPOS_BOUNDARY 10					// Maximum distance of a new (adaptive) position from the neighbour it is allocated next to
+#define FPOS_BASE_SIZE 32					// Width of the interval used for an unbounded level at depth 0 (doubled at each depth)
+#define FPOS_MAX_BASE_SHIFT 24				// (limits the growth of the base in very deep levels)
+
+#define DOCUMENT_FILE_MAGIC 0x4C544446		// First field of a document file saved as a single stream, followed by the version of its layout ("LTDF")
+#define DOCUMENT_FILE_VERSION 8				// (the last layout of the streams, which are still read)
+#define DOCUMENT_PAGED_MAGIC 0x4C545046		// First field of a document file which holds a page directory ("LTPF")
+#define DOCUMENT_PAGED_VERSION 3				// (version 1 had no compressed pages, version 2 no summaries of the chunk pages)
+
+
+/* Location of a page in the pages file of a document */
+struct FilePage
+{
+	qint64 offset;
+	quint32 size;
+	bool compressed;		// (zlib stream of the page contents)
+	PageSummary summary;	// (of a chunk page, so that it is neither inflated nor decoded when the document is loaded)
+};
+
+/* Tables of the document which are stored in a page each */
+enum DocumentTable
+{
+	FormatTable,
+	BlockTable,
+	ListTable,
+	TableCount
+};
+
+/* The pages of a document which are already on disk, and the contents they were written from: chunks of the
+   text are identified by their data (or by their page, if they were never decoded), which a chunk only keeps
+   as long as it is not modified (it is shared with the copy held here), while tables are compared with their
+   last serialization */
+struct DocumentPages
+{
+	quint32 generation = 0;		// number of the pages file, a new one is written once the old one is mostly unused
+	qint64 liveBytes = 0;		// bytes of the pages file referenced by the directory
+	QByteArray directory;		// (as last committed)
+
+	QByteArray tables[TableCount];
+	FilePage tablePages[TableCount];
+
+	QHash<const void*, FilePage> chunkPages;
+	QVector<SymbolChunk> chunks;
+
+	QWeakPointer<QFile> mapped;		// pages file mapped by the text which was loaded (and by its snapshots)
+};
+
+
+// Deleter of a mapped pages file, which also removes it from disk if a newer generation replaced it meanwhile
+static void releasePagesFile(QFile* file)
+{
+	QString name = file->fileName();
+	bool obsolete = file->property("obsolete").toBool();
+
+	delete file;		// (unmaps the pages)
+
+	if (obsolete && !QFile::remove(name))
+		qWarning() << "Could not delete the old pages file" << name;
+}
 
 
 URI::URI()
@@ -79,22 +144,24 @@ QDataStream& operator<<(QDataStream& out, const URI& uri)
 
 
 Document::Document()
-	: _blockCounter(0), _listCounter(0)
+	: _blockCounter(0), _listCounter(0), _posStrategy(FixedGapAllocation), _epoch(0), _lazyRemoval(false), _editThreads(1), _journal(0),
+	_compression(0), _pages(new DocumentPages)
 {
 }
 
-Document::Document(URI docURI, qint32 authorId) :
-	uri(docURI), _blockCounter(0), _listCounter(0)
+Document::Document(URI docURI, qint32 authorId, PositionStrategy strategy) :
+	uri(docURI), _blockCounter(0), _listCounter(0), _posStrategy(strategy), _epoch(0), _lazyRemoval(false), _editThreads(1), _journal(0),
+	_compression(0), _pages(new DocumentPages)
 {
 	// Insert a ParagraphTerminator character inside a default block in the empty document
 	TextBlock defaultBlock = TextBlock(_blockCounter++, authorId, QTextBlockFormat());
-	Symbol eof = Symbol(QChar::ParagraphSeparator, QTextCharFormat(), Position({ 0, authorId }));
+	Symbol eof = Symbol(QChar::ParagraphSeparator, CHARFORMAT_DEFAULT, Position({ 0, authorId }));
 	defaultBlock.setBegin(eof.getPosition());
 	defaultBlock.setEnd(eof.getPosition());
-	eof.setBlock(defaultBlock.getId());
 
 	_blocks.insert(defaultBlock.getId(), defaultBlock);
-	_text.insert(_text.begin(), eof);
+	_blockEnds.insert(defaultBlock.end(), defaultBlock.getId());
+	_text.insert(0, eof);
 }
 
 Document::~Document()
@@ -123,7 +190,7 @@ QString Document::getAuthor() const
 
 QVector<Symbol> Document::getContent() const
 {
-	return _text;
+	return _text.toVector();
 }
 
 int Document::length() const
@@ -133,12 +200,55 @@ int Document::length() const
 
 QString Document::toString() const
 {
-	QString text;
+	return _text.text(0, _text.size());
+}
+
+bool Document::hasSameContents(const Document& other) const
+{
+	if (_text.size() != other._text.size())
+		return false;
+
+	// The symbols are compared one by one (their format indexes refer to the pool of each document)
+	SymbolSequence::const_iterator a = _text.begin(), b = other._text.begin();
+	for (int i = 0; a != _text.end(); a++, b++, i++)
+	{
+		if (a->getChar() != b->getChar() || getCharFormat(a->getFormatIndex()) != other.getCharFormat(b->getFormatIndex()))
+			return false;
+
+		// Each block (and its list) is compared at its last char
+		if (a->getChar() == QChar::ParagraphSeparator || i == _text.size() - 1)
+		{
+			TextBlock blockA = _blocks.value(getBlockAt(i));
+			TextBlock blockB = other._blocks.value(other.getBlockAt(i));
+
+			if (blockA.getId() != blockB.getId() || blockA.getFormat() != blockB.getFormat()
+				|| blockA.getListId() != blockB.getListId())
+				return false;
+
+			if (blockA.getListId() && _lists.value(blockA.getListId()).getFormat() != other._lists.value(blockB.getListId()).getFormat())
+				return false;
+		}
+	}
+
+	return true;
+}
 
-	for (QVector<Symbol>::const_iterator i = _text.begin(); i != _text.end(); i++)
-		text.append(i->getChar());
+PositionStrategy Document::getPositionStrategy() const
+{
+	return _posStrategy;
+}
 
-	return text;
+quint32 Document::getEpoch() const
+{
+	return _epoch;
+}
+
+QPair<double, int> Document::getPositionDepth() const
+{
+	// (the chunks which are still encoded in their pages are not decoded)
+	QPair<qint64, int> levels = _text.positionLevels();
+
+	return QPair<double, int>(_text.isEmpty() ? 0.0 : double(levels.first) / _text.size(), levels.second);
 }
 
 
@@ -146,14 +256,14 @@ Symbol& Document::operator[](const Position& fPos)
 {
 	int pos = findPosition(fPos);
 	if (pos >= 0 && pos < _text.size())
-		return _text[pos];
+		return _text.symbolAt(pos);
 	else throw std::out_of_range("The document doesn't contain any symbol with that fractional position");
 }
 
 Symbol& Document::operator[](int pos)
 {
 	if (pos >= 0 && pos < _text.size())
-		return _text[pos];
+		return _text.symbolAt(pos);
 	else throw std::out_of_range("The document doesn't contain any symbol with that index");
 }
 
@@ -161,6 +271,26 @@ Symbol& Document::operator[](int pos)
 /************* DOCUMENT FILE METHODS (Server only) *************/
 
 
+template<class T>
+static QByteArray toPage(const T& table)
+{
+	QByteArray page;
+	QDataStream out(&page, QIODevice::WriteOnly);
+
+	out << table;
+	return page;
+}
+
+template<class T>
+static bool fromPage(const QByteArray& page, T& table)
+{
+	QDataStream in(page);
+
+	in >> table;
+	return in.status() == QDataStream::Status::Ok;
+}
+
+
 void Document::load()
 {
 	// Open the document file on disk, and read data from it
@@ -168,15 +298,51 @@ void Document::load()
 	if (file.open(QIODevice::ReadOnly | QIODevice::ExistingOnly))
 	{
 		QDataStream docFileStream(&file);
+		quint32 magic = 0;
+		quint32 version = 0;
+
+		_pages.reset(new DocumentPages);
 
-		// Load the document content from file via deserialization
 		if (!docFileStream.atEnd())
-			docFileStream >> _blockCounter >> _blocks >> _listCounter >> _lists >> _text;
+			docFileStream >> magic;
+
+		if (magic == DOCUMENT_PAGED_MAGIC)
+		{
+			// The file is the directory of the pages which hold the document content
+			if (!readPages(docFileStream))
+				throw DocumentLoadException(uri.toStdString(), DOCUMENTS_DIRNAME);
+		}
+		else if (magic == DOCUMENT_FILE_MAGIC)
+		{
+			// Load the document content from file via deserialization (saved before the pages were introduced)
+			qint32 strategy;
+
+			docFileStream >> version;
+			if (version != DOCUMENT_FILE_VERSION)
+				throw DocumentLoadException(uri.toStdString(), DOCUMENTS_DIRNAME);
+
+			docFileStream >> _blockCounter >> _blocks >> _listCounter >> _lists >> strategy >> _epoch >> _formats >> _text >> _journal;
+			_posStrategy = PositionStrategy(strategy);
+		}
+		else
+		{
+			// The file has no magic, it holds the contents of a document saved by the first versions
+			file.seek(0);
+
+			if (!docFileStream.atEnd())
+				readBaseline(docFileStream);
+		}
 
 		if (docFileStream.status() != QDataStream::Status::Ok)
 			throw DocumentLoadException(uri.toStdString(), DOCUMENTS_DIRNAME);
 
+		rebuildBlockIndex();
+
 		file.close();
+
+		// Replay the edits of the journals which follow the saved contents, the new edits go to the next one
+		while (DocumentJournal::replay(getJournalName(), *this) >= 0)
+			_journal++;
 	}
 	else
 	{
@@ -187,35 +353,159 @@ void Document::load()
 void Document::unload()
 {
 	// Unload the Document object contents from memory
+	_pages.reset(new DocumentPages);		// (releases the copies of the chunks kept to detect their changes)
 	_lists.clear();
 	_blocks.clear();
-	_text.clear();
-	_text.squeeze();		// release allocated but unused memory until the document gets reloaded
+	_blockEnds.clear();
+	_text.clear();			// (releases all the chunks of the symbol sequence, the arena of their positions, and the mapped pages)
+	_formats.clear();
 }
 
 void Document::save()
 {
-	// Create or overwrite the document file on disk, and write data to it
-	QSaveFile file(DOCUMENTS_DIRNAME + uri.toString());
-	if (QDir().mkpath(DOCUMENTS_DIRNAME) && file.open(QIODevice::WriteOnly))
+	DocumentPages& saved = *_pages;
+
+	QVector<SymbolChunk> chunks = _text.chunks();
+	QByteArray tables[TableCount] = { toPage(_formats), toPage(_blocks), toPage(_lists) };
+
+	// Open the pages file, new pages are appended after the ones which may still be referenced by the directory
+	QFile pagesFile(getPagesName(saved.generation));
+	if (!QDir().mkpath(DOCUMENTS_DIRNAME) || !pagesFile.open(QIODevice::ReadWrite))
+		throw DocumentCreateException(uri.toStdString(), DOCUMENTS_DIRNAME);
+
+	// Once most of the file is made of old pages, all the live ones are rewritten to a new file
+	quint32 generation = saved.generation;
+	bool rewrite = pagesFile.size() - saved.liveBytes > saved.liveBytes;
+
+	if (rewrite)
 	{
-		QDataStream docFileStream(&file);
+		pagesFile.close();
+		pagesFile.setFileName(getPagesName(++generation));
+		if (!pagesFile.open(QIODevice::ReadWrite | QIODevice::Truncate))
+			throw DocumentCreateException(uri.toStdString(), DOCUMENTS_DIRNAME);
+	}
 
-		// Write the the current document content to file
-		docFileStream << _blockCounter << _blocks << _listCounter << _lists << _text;
+	qint64 liveBytes = 0;
+	bool appended = false;
 
-		if (docFileStream.status() == QDataStream::Status::WriteFailed)
-		{
-			file.cancelWriting();
-			file.commit();
+	// Each new page is written to the end of the file as soon as it is made, instead of being kept until the end
+	if (!pagesFile.seek(pagesFile.size()))
+		throw DocumentWriteException(uri.toStdString(), DOCUMENTS_DIRNAME);
+
+	auto store = [this, &pagesFile, &liveBytes, &appended](const QByteArray& stored, bool compressed, const PageSummary& summary) -> FilePage {
+		FilePage p = { pagesFile.pos(), quint32(stored.size()), compressed, summary };
+		if (pagesFile.write(stored) != stored.size())
 			throw DocumentWriteException(uri.toStdString(), DOCUMENTS_DIRNAME);
+
+		liveBytes += stored.size();
+		appended = true;
+		return p;
+	};
+
+	// Each page is compressed on its own (if enabled), as it is appended
+	int level = _compression;
+	auto append = [&store, level](const QByteArray& page, const PageSummary& summary = PageSummary()) {
+		return store(level > 0 ? qCompress(page, level) : page, level > 0, summary);
+	};
+
+	// Only the tables whose contents changed, and the chunks which are not shared with the saved ones, are written
+	FilePage tablePages[TableCount];
+	for (int t = 0; t < TableCount; t++)
+	{
+		if (!rewrite && tables[t] == saved.tables[t])
+		{
+			tablePages[t] = saved.tablePages[t];
+			liveBytes += tablePages[t].size;
 		}
+		else
+			tablePages[t] = append(tables[t]);
+	}
 
-		file.commit();
+	QHash<const void*, FilePage> chunkPages;
+	chunkPages.reserve(chunks.size());
+
+	for (const SymbolChunk& chunk : chunks)
+	{
+		FilePage p;
+		if (!rewrite && saved.chunkPages.contains(chunk.id()))
+		{
+			p = saved.chunkPages.value(chunk.id());
+			liveBytes += p.size;
+		}
+		else if (!chunk.page.isNull())
+			p = store(chunk.page, chunk.compressed, chunk.summary);		// (a page never decoded is copied as it is)
+		else
+		{
+			QByteArray page;
+			QDataStream out(&page, QIODevice::WriteOnly);
+			PageSummary summary = SymbolSequence::writeChunk(out, chunk);
+
+			p = append(page, summary);
+		}
+		chunkPages.insert(chunk.id(), p);
 	}
-	else
+
+	// Write the directory of the pages which make up the current document content
+	QByteArray directory;
+	QDataStream dirStream(&directory, QIODevice::WriteOnly);
+
+	dirStream << quint32(DOCUMENT_PAGED_MAGIC) << quint32(DOCUMENT_PAGED_VERSION) << _blockCounter << _listCounter
+		<< qint32(_posStrategy) << _epoch << _journal << generation;
+
+	for (const FilePage& p : tablePages)
+		dirStream << p.offset << p.size << p.compressed;
+
+	dirStream << quint32(chunks.size());
+	for (const SymbolChunk& chunk : chunks)
 	{
+		const FilePage& p = chunkPages[chunk.id()];
+		dirStream << p.offset << p.size << p.summary.count << p.compressed << p.summary.head << p.summary.levels << p.summary.depth;
+	}
+
+	if (!appended && directory == saved.directory)
+		return;		// Nothing changed since the last save
+
+	// The new pages must be on disk before the directory which references them replaces the old one
+	if (appended && !DocumentJournal::syncToDisk(pagesFile))
+		throw DocumentWriteException(uri.toStdString(), DOCUMENTS_DIRNAME);
+
+	pagesFile.close();
+
+	QSaveFile file(DOCUMENTS_DIRNAME + uri.toString());
+	if (!file.open(QIODevice::WriteOnly))
 		throw DocumentCreateException(uri.toStdString(), DOCUMENTS_DIRNAME);
+
+	if (file.write(directory) != directory.size())
+	{
+		file.cancelWriting();
+		file.commit();
+		throw DocumentWriteException(uri.toStdString(), DOCUMENTS_DIRNAME);
+	}
+
+	if (!file.commit())
+		throw DocumentWriteException(uri.toStdString(), DOCUMENTS_DIRNAME);
+
+	// Keep what was saved, to find out which pages change before the next save
+	saved.generation = generation;
+	saved.liveBytes = liveBytes;
+	saved.directory = directory;
+	for (int t = 0; t < TableCount; t++)
+	{
+		saved.tables[t] = tables[t];
+		saved.tablePages[t] = tablePages[t];
+	}
+	saved.chunkPages = chunkPages;
+	saved.chunks = chunks;
+
+	if (rewrite)
+	{
+		// The old pages files are deleted, except the one still mapped by the text (or by its snapshots),
+		// which is deleted once none of them maps it anymore
+		QSharedPointer<QFile> mapped = saved.mapped.toStrongRef();
+		if (mapped)
+			mapped->setProperty("obsolete", true);
+
+		removeFiles(PAGES_FILE_EXTENSION, generation, mapped ? QFileInfo(mapped->fileName()).fileName() : QString());
 	}
 }
 
@@ -223,6 +513,228 @@ void Document::erase()
 {
 	// Delete the document from the local file system
 	QFile(DOCUMENTS_DIRNAME + uri.toString()).remove();
+	removeFiles(PAGES_FILE_EXTENSION, UINT_MAX);
+	removeFiles(JOURNAL_FILE_EXTENSION, UINT_MAX);
+}
+
+bool Document::readPages(QDataStream& in)
+{
+	quint32 version, generation, nChunks;
+	qint32 strategy;
+	FilePage tablePages[TableCount];
+
+	in >> version;
+	if (in.status() != QDataStream::Status::Ok || version > DOCUMENT_PAGED_VERSION)
+		return false;
+
+	in >> _blockCounter >> _listCounter >> strategy >> _epoch >> _journal >> generation;
+	_posStrategy = PositionStrategy(strategy);
+
+	for (FilePage& p : tablePages)
+	{
+		in >> p.offset >> p.size;
+		p.compressed = false;
+		if (version > 1)
+			in >> p.compressed;
+	}
+
+	in >> nChunks;
+	QVector<FilePage> chunkPages;
+
+	for (quint32 i = 0; i < nChunks && in.status() == QDataStream::Status::Ok; i++)
+	{
+		FilePage p;
+		in >> p.offset >> p.size >> p.summary.count;
+		p.compressed = false;
+		if (version > 1)
+			in >> p.compressed;
+		if (version > 2)
+			in >> p.summary.head >> p.summary.levels >> p.summary.depth;		// (the pages without it are scanned when mapped)
+		chunkPages.append(p);
+	}
+
+	if (in.status() != QDataStream::Status::Ok)
+		return false;
+
+	QSharedPointer<QFile> pagesFile(new QFile(getPagesName(generation)), releasePagesFile);
+	if (!pagesFile->open(QIODevice::ReadOnly | QIODevice::ExistingOnly))
+		return false;
+
+	// The file is mapped in memory (or read, if it can't be mapped), so that its pages are only read when decoded
+	qint64 size = pagesFile->size();
+	const char* data = size > 0 ? reinterpret_cast<const char*>(pagesFile->map(0, size)) : nullptr;
+	QByteArray contents;
+
+	if (!data)
+	{
+		contents = pagesFile->readAll();
+		data = contents.constData();
+		size = contents.size();
+		pagesFile.reset();		// (the pages are copied, there is no mapping to keep)
+	}
+
+	auto isInside = [size](const FilePage& p) { return p.offset >= 0 && p.offset + p.size <= size; };
+
+	// The pages point into the mapping of the file, until their chunk is decoded
+	auto storedAt = [data, &pagesFile](const FilePage& p) {
+		if (pagesFile)
+			return QByteArray::fromRawData(data + p.offset, int(p.size));
+		else return QByteArray(data + p.offset, int(p.size));
+	};
+
+	DocumentPages& saved = *_pages;
+	qint64 liveBytes = 0;
+
+	for (int t = 0; t < TableCount; t++)
+	{
+		const FilePage& p = tablePages[t];
+		if (!isInside(p))
+			return false;
+
+		// The tables are read right away (a compressed one is inflated, to an empty table if its stream is corrupt)
+		saved.tables[t] = p.compressed ? qUncompress(reinterpret_cast<const uchar*>(data + p.offset), int(p.size)) : storedAt(p);
+		saved.tables[t].detach();		// (the table is kept to be compared with the next saves, even after the file is unmapped)
+		saved.tablePages[t] = p;
+		liveBytes += p.size;
+	}
+
+	if (!fromPage(saved.tables[FormatTable], _formats) || !fromPage(saved.tables[BlockTable], _blocks)
+		|| !fromPage(saved.tables[ListTable], _lists))
+		return false;
+
+	// Each chunk of the text keeps its page (still compressed), and only inflates and decodes it when it is first accessed
+	QVector<SymbolChunk> pages;
+
+	for (const FilePage& p : chunkPages)
+	{
+		if (!isInside(p))
+			return false;
+
+		SymbolChunk page;
+		page.page = storedAt(p);
+		page.compressed = p.compressed;
+		page.summary = p.summary;
+		pages.append(page);
+		liveBytes += p.size;
+	}
+
+	if (!_text.mapChunks(pages, pagesFile))
+		return false;
+
+	// (the chunks of the text are the pages in the directory, in the same order)
+	saved.chunks = _text.chunks();
+	if (saved.chunks.size() != chunkPages.size())
+		return false;
+
+	for (int i = 0; i < chunkPages.size(); i++)
+	{
+		chunkPages[i].summary = saved.chunks[i].summary;		// (as scanned, if the directory had none)
+		saved.chunkPages.insert(saved.chunks[i].id(), chunkPages[i]);
+	}
+
+	saved.generation = generation;
+	saved.liveBytes = liveBytes;
+	saved.mapped = pagesFile;
+
+	// Sweep the pages files of older generations which could not be deleted when they were replaced
+	removeFiles(PAGES_FILE_EXTENSION, generation);
+
+	return true;
+}
+
+
+QString Document::getJournalName() const
+{
+	return DOCUMENTS_DIRNAME + getURI().toString() + "." + QString::number(_journal) + JOURNAL_FILE_EXTENSION;
+}
+
+QString Document::getPagesName(quint32 generation) const
+{
+	return DOCUMENTS_DIRNAME + getURI().toString() + "." + QString::number(generation) + PAGES_FILE_EXTENSION;
+}
+
+void Document::beginJournal()
+{
+	_journal++;
+}
+
+void Document::removeOldJournals()
+{
+	removeFiles(JOURNAL_FILE_EXTENSION, _journal);
+}
+
+void Document::removeFiles(const QString& extension, quint32 before, const QString& except)
+{
+	QDir dir(DOCUMENTS_DIRNAME);
+	QString prefix = getURI().toString() + ".";
+
+	for (const QString& name : dir.entryList(QStringList(prefix + "*" + extension), QDir::Files))
+	{
+		bool valid;
+		quint32 number = name.mid(prefix.size()).section('.', 0, 0).toUInt(&valid);
+
+		if (valid && number < before && name == prefix + QString::number(number) + extension && name != except)
+		{
+			if (!dir.remove(name))
+				qWarning() << "Could not delete the old document file" << name;
+		}
+	}
+}
+
+Document Document::snapshot() const
+{
+	// The maps and the format pool are implicitly shared, and the symbol sequence only copies the nodes
+	// above its chunks: the snapshot can be saved by another thread while this document keeps being edited
+	return Document(*this);
+}
+
+
+void Document::readBaseline(QDataStream& in)
+{
+	// Layout: _blockCounter, _blocks, _listCounter, _lists (whose blocks are unordered), and a vector
+	// of symbols which carry their whole char format
+	quint32 n;
+
+	in >> _blockCounter >> _blocks >> _listCounter >> n;
+
+	for (quint32 i = 0; i < n && in.status() == QDataStream::Status::Ok; i++)
+	{
+		TextListID key;
+		TextListID listId;
+		QTextListFormat fmt;
+		QList<TextBlockID> blocks;
+
+		in >> key >> listId >> fmt >> blocks;
+
+		// (the blocks of a list are now ordered by their begin position)
+		TextList list(listId, fmt);
+		for (TextBlockID blockId : blocks)
+			list.addBlock(blockId, _blocks[blockId].begin());
+
+		_lists.insert(key, list);
+	}
+
+	in >> n;
+
+	QVector<Symbol> symbols;
+	for (quint32 i = 0; i < n && in.status() == QDataStream::Status::Ok; i++)
+	{
+		QChar c;
+		QTextCharFormat fmt;
+		Position fPos;
+		TextBlockID blockRef;
+
+		in >> c >> fmt >> fPos >> blockRef;
+
+		// (the symbols only store the index of their format in the pool, the blocks are found from their boundaries)
+		symbols.append(Symbol(c, _formats.intern(fmt), fPos));
+	}
+
+	_text.assign(symbols);
+
+	_posStrategy = FixedGapAllocation;		// (the only strategy of the first versions)
+	_epoch = 0;
+	_journal = 0;		// (the journals which follow the contents are numbered from 0)
 }
 
 
@@ -252,9 +764,11 @@ int Document::insert(Symbol& s, int hint)
 	}
 
 	if (insertPos < 0)
+	{
 		insertPos = insertionIndex(s.getPosition());	// Search for the insertion position
-
-	assert(insertPos >= 0);
+		if (insertPos < 0)
+			return -1;		// Early out if the symbol is already in the document
+	}
 
 	// Check if the inserted symbol implies the creation of a new block
 	if (_text.empty() || (s.getChar() == QChar::ParagraphSeparator && insertPos < _text.size())
@@ -268,8 +782,6 @@ int Document::insert(Symbol& s, int hint)
 			// Create a new TextBlock with locally-generated ID
 			TextBlockID blockId(_blockCounter++, s.getAuthorId());
 			block = _blocks.insert(blockId, TextBlock(blockId, QTextBlockFormat()));
-
-			s.setBlock(blockId);
 		}
 		else	// (symbol received from remote)
 		{
@@ -279,19 +791,28 @@ int Document::insert(Symbol& s, int hint)
 			_blockCounter++;	// (keep the block counter aligned between clients)
 		}
 
+		// Symbols are stored without a block reference (membership is given by the block boundaries)
+		s.setBlock(nullptr);
+
 		// Check if it's needed to split blocks
 		if (s.getChar() == QChar::ParagraphSeparator && !_text.empty() && insertPos != _text.size())
 		{
 			TextBlock& prevBlock = _blocks[getBlockAt(insertPos)];
+			Position prevEnd = prevBlock.end();
 
-			// The paragraph delimiter belongs to the previous block
-			s.setBlock(nullptr);
-			addCharToBlock(s, prevBlock);
-			_text.insert(_text.begin() + insertPos, s);
+			// The paragraph delimiter belongs to the previous block, which now ends with it
+			_text.insert(insertPos, s);
+			if (s.getPosition() < prevBlock.begin())
+				setBlockBegin(prevBlock, s.getPosition());
+			setBlockEnd(prevBlock, s.getPosition());
 
 			// The new paragraph inherits the format attributes from the previous one
 			block->setFormat(prevBlock.getFormat());
 
+			// All the following symbols of that paragraph are assigned to the new block
+			block->setBegin(_text[insertPos + 1].getPosition());
+			setBlockEnd(*block, prevEnd);
+
 			// Migrate the list belonging from the previous to the new block
 			if (prevBlock.getListId())
 			{
@@ -299,36 +820,97 @@ int Document::insert(Symbol& s, int hint)
 				addBlockToList(*block, list);
 				removeBlockFromList(prevBlock, list);
 			}
-
-			// All the following symbols of that paragraph are assigned to the new block
-			for (int i = findPosition(prevBlock.end()); i > insertPos; i--) {
-				addCharToBlock(_text[i], *block);
-			}
-
-			// We guarantee that this copy of the symbol contains the ID of the block that was created
-			// because of its insertion (even though in _text it belongs to another block)
-			s.setBlock(block->getId());
 		}
 		else
 		{
 			// Insert the symbol in the document
-			addCharToBlock(s, *block);
-			_text.insert(_text.begin() + insertPos, s);
+			addCharToBlock(s.getPosition(), *block);
+			_text.insert(insertPos, s);
 		}
+
+		// We guarantee that this copy of the symbol contains the ID of the block that was created
+		// because of its insertion (even though in _text it may belong to another block)
+		s.setBlock(block->getId());
 	}
 	else	// Inserting a regular symbol in the document
 	{
 		// Assign the character to the block on which it is inserted
 		TextBlockID blockId = (insertPos == _text.size() ?
 			getBlockAt(insertPos - 1) : getBlockAt(insertPos));		// the last char belongs to the previous block
-		addCharToBlock(s, _blocks[blockId]);
-		_text.insert(_text.begin() + insertPos, s);
+		addCharToBlock(s.getPosition(), _blocks[blockId]);
+
+		s.setBlock(nullptr);
+		_text.insert(insertPos, s);
+		s.setBlock(blockId);
 	}
 
 	return insertPos;
 }
 
 
+QList<QPair<int, int>> Document::insertRange(QVector<Symbol>& symbols)
+{
+	QList<QPair<int, int>> ranges;
+	auto precedes = [](const Symbol& a, const Symbol& b) { return a.getPosition().compare(b.getPosition()) < 0; };
+
+	// Sort the batch by fractional position (it usually already is), so that the symbols which fall
+	// in the same gap of the document are consecutive, and are inserted at once
+	if (!std::is_sorted(symbols.begin(), symbols.end(), precedes))
+		std::sort(symbols.begin(), symbols.end(), precedes);
+
+	for (int i = 0; i < symbols.size(); )
+	{
+		int index = insertionIndex(symbols[i].getPosition());
+		int length = 1;
+
+		if (index < 0)
+		{
+			i++;
+			continue;		// (the symbol was already in the document)
+		}
+
+		if (_text.empty() || symbols[i].getChar() == QChar::ParagraphSeparator
+			|| (index == _text.size() && _text[index - 1].getChar() == QChar::ParagraphSeparator))
+		{
+			// The symbol changes the blocks of the document
+			insert(symbols[i], index);
+		}
+		else
+		{
+			// The following regular symbols which precede the next one of the document are inserted in the same gap
+			const Position* next = index < _text.size() ? &_text[index].getPosition() : nullptr;
+			while (i + length < symbols.size() && symbols[i + length].getChar() != QChar::ParagraphSeparator
+				&& (!next || symbols[i + length].getPosition() < *next)
+				&& symbols[i + length - 1].getPosition() < symbols[i + length].getPosition())
+				length++;
+
+			// All of them belong to the block on which they are inserted, whose boundaries are updated once
+			TextBlockID blockId = (index == _text.size() ? getBlockAt(index - 1) : getBlockAt(index));
+			TextBlock& block = _blocks[blockId];
+			addCharToBlock(symbols[i].getPosition(), block);
+			addCharToBlock(symbols[i + length - 1].getPosition(), block);
+
+			QVector<Symbol> run = symbols.mid(i, length);
+			for (Symbol& s : run)
+				s.setBlock(nullptr);
+			_text.insert(index, run);
+
+			for (int n = i; n < i + length; n++)
+				symbols[n].setBlock(blockId);
+		}
+
+		// Extend the last range if the symbols follow it, otherwise begin a new one
+		if (!ranges.isEmpty() && ranges.last().first + ranges.last().second == index)
+			ranges.last().second += length;
+		else ranges.append(QPair<int, int>(index, length));
+
+		i += length;
+	}
+
+	return ranges;
+}
+
+
 int Document::remove(const Position& fPos, int hint)
 {
 	int pos = -1;
@@ -345,25 +927,26 @@ int Document::remove(const Position& fPos, int hint)
 			return -1;					// Early out if the symbol has already been deleted
 	}
 
-	Symbol& s = _text[pos];
-	TextBlock& block = _blocks[s.getBlockId()];
+	const Symbol& s = _text[pos];
+	TextBlock& block = _blocks[getBlockAt(pos)];
 
 	// Check if the symbol removal implies the merging of two blocks
 	if (s.getChar() == QChar::ParagraphSeparator && pos < _text.size() - 1 &&
 		!(block.begin() == block.end()))
 	{
 		// All symbols belonging to the next block will be assigned to the current block
-		for (int i = pos + 1; i < _text.size(); i++)
-		{
-			addCharToBlock(_text[i], block);
-			if (_text[i].getChar() == QChar::ParagraphSeparator)
-				break;
-		}
+		TextBlock& next = _blocks[getBlockAt(pos + 1)];
+		Position nextEnd = next.end();
+
+		deleteBlock(next);
+		setBlockEnd(block, nextEnd);
 	}
 
 	// Remove the symbol from the document
-	removeCharFromBlock(s, block);
-	_text.removeAt(pos);
+	removeCharFromBlock(s.getPosition(), block);
+	if (_lazyRemoval)
+		_text.tombstone(pos);
+	else _text.removeAt(pos);
 
 	return pos;
 }
@@ -380,6 +963,374 @@ Position Document::removeAtIndex(int index)
 }
 
 
+/* Removes a contiguous range of symbols, leaving the document in the same state as removing them one by one
+   (from the first): blocks are only updated once, instead of merging and splitting them at every paragraph */
+int Document::removeRange(int from, int count)
+{
+	from = std::clamp<int>(from, 0, _text.size());
+	count = std::clamp<int>(count, 0, _text.size() - from);
+	if (count == 0)
+		return 0;
+
+	int end = from + count;
+	int last = _text.size() - 1;
+
+	// Only the first block of the range (head) can begin before it
+	TextBlockID headId = getBlockAt(from);
+	int headBegin = findPosition(_blocks[headId].begin());
+	int headEnd = findPosition(_blocks[headId].end());
+
+	// The head absorbs the following paragraphs if its delimiter is removed while it still has other chars
+	bool merge = headBegin < from && headEnd < end && headEnd < last;
+
+	if (headEnd >= end)
+	{
+		// The range is inside the head block
+		if (headBegin == from)
+			setBlockBegin(_blocks[headId], _text[end].getPosition());
+	}
+	else
+	{
+		// Delete the blocks which are entirely inside the range
+		int i = headEnd + 1;
+		while (i < end)
+		{
+			TextBlock& block = _blocks[getBlockAt(i)];
+			int blockEnd = findPosition(block.end());
+			if (blockEnd >= end)
+				break;
+
+			deleteBlock(block);
+			i = blockEnd + 1;
+		}
+
+		// Block which contains the first symbol after the range (if it's already touched by the range or is merged)
+		TextBlockID tailId = nullptr;
+		if (i < end || (merge && end <= last))
+			tailId = getBlockAt(end);
+
+		if (merge)
+		{
+			if (tailId)
+			{
+				// All the remaining chars of the tail block now belong to the head
+				Position tailEnd = _blocks[tailId].end();
+				deleteBlock(_blocks[tailId]);
+				setBlockEnd(_blocks[headId], tailEnd);
+			}
+			else setBlockEnd(_blocks[headId], _text[from - 1].getPosition());
+		}
+		else
+		{
+			if (headBegin < from)
+				setBlockEnd(_blocks[headId], _text[from - 1].getPosition());		// (the range reaches the end of the document)
+			else deleteBlock(_blocks[headId]);
+
+			if (tailId)
+				setBlockBegin(_blocks[tailId], _text[end].getPosition());
+		}
+	}
+
+	// Remove the symbols from the sequence
+	if (_lazyRemoval)
+		_text.tombstone(from, count);
+	else _text.removeRange(from, count);
+
+	return count;
+}
+
+QList<QPair<int, int>> Document::removeRange(QVector<Position> positions)
+{
+	QList<QPair<int, int>> ranges;
+	QVector<int> indexes;
+
+	// Translate the positions into indexes, skipping the symbols which were already deleted
+	indexes.reserve(positions.size());
+	for (const Position& fPos : positions)
+	{
+		int index = findPosition(fPos);
+		if (index >= 0)
+			indexes.append(index);
+	}
+
+	std::sort(indexes.begin(), indexes.end());
+	indexes.erase(std::unique(indexes.begin(), indexes.end()), indexes.end());
+
+	// Remove each contiguous run at once (indexes of the following runs shift back after every removal)
+	int removed = 0;
+	for (int i = 0; i < indexes.size(); )
+	{
+		int j = i + 1;
+		while (j < indexes.size() && indexes[j] == indexes[j - 1] + 1)
+			j++;
+
+		int start = indexes[i] - removed;
+		removeRange(start, j - i);
+		ranges.append(QPair<int, int>(start, j - i));
+
+		removed += j - i;
+		i = j;
+	}
+
+	return ranges;
+}
+
+
+void Document::setLazyRemoval(bool enabled)
+{
+	_lazyRemoval = enabled;
+}
+
+int Document::tombstones() const
+{
+	return _text.tombstones();
+}
+
+void Document::purgeTombstones()
+{
+	_text.purge();
+}
+
+
+void Document::setPositionIndex(bool enabled)
+{
+	_text.setIndexed(enabled);
+}
+
+
+void Document::setEditThreads(int nThreads)
+{
+	_editThreads = std::max(1, nThreads);
+}
+
+void Document::setCompression(int level)
+{
+	_compression = std::clamp(level, 0, 9);
+}
+
+void Document::packText()
+{
+	DocumentPages& saved = *_pages;
+	QVector<SymbolChunk> before = _text.chunks();
+
+	if (_text.pack() == 0)
+		return;
+
+	// A packed chunk has the same contents as before, so the page where they were saved is still valid
+	// (and the saved copy of its symbols is released)
+	QVector<SymbolChunk> after = _text.chunks();
+	Q_ASSERT(after.size() == before.size());
+
+	for (int i = 0; i < after.size(); i++)
+	{
+		const void* id = before[i].id();
+		if (after[i].id() != id && saved.chunkPages.contains(id))
+		{
+			saved.chunkPages.insert(after[i].id(), saved.chunkPages.take(id));
+			saved.chunks.append(after[i]);
+		}
+	}
+
+	saved.chunks.erase(std::remove_if(saved.chunks.begin(), saved.chunks.end(),
+		[&saved](const SymbolChunk& chunk) { return !saved.chunkPages.contains(chunk.id()); }), saved.chunks.end());
+}
+
+int Document::applyEdits(QVector<SymbolEdit> edits)
+{
+	QVector<SymbolEdit> run;
+	int applied = 0;
+
+	for (SymbolEdit& e : edits)
+	{
+		if (isInsideBlock(e))
+		{
+			e.symbol.setBlock(nullptr);		// (block membership is given by the boundaries)
+			run.append(e);
+			continue;
+		}
+
+		// The edit changes the blocks: apply the run of edits which precedes it, and then this one alone
+		applied += _text.apply(run, _editThreads);
+		run.clear();
+
+		if (e.type == SymbolEdit::Insertion)
+			applied += insert(e.symbol) >= 0 ? 1 : 0;
+		else applied += remove(e.symbol.getPosition()) >= 0 ? 1 : 0;
+	}
+
+	return applied + _text.apply(run, _editThreads);
+}
+
+
+void Document::compactPositions()
+{
+	QMap<TextBlockID, QPair<int, int>> bounds;
+
+	_text.purge();		// (tombstones would keep their old positions)
+
+	// Translate the block boundaries to indexes, and take the blocks out of their (position-keyed) lists
+	for (QMap<TextBlockID, TextBlock>::iterator b = _blocks.begin(); b != _blocks.end(); b++)
+	{
+		if (b->isEmpty())
+			continue;
+
+		bounds.insert(b.key(), QPair<int, int>(findPosition(b->begin()), findPosition(b->end())));
+		if (b->getListId())
+			_lists[b->getListId()].removeBlock(b.key(), b->begin());
+	}
+
+	// Renumber the symbols in order, keeping their author as the last level of the position
+	bool indexed = _text.isIndexed();
+	_text.setIndexed(false);		// (the positions are rewritten in place, the index is rebuilt afterwards)
+
+	qint32 value = 0;
+	for (SymbolSequence::iterator s = _text.begin(); s != _text.end(); s++, value += FPOS_GAP_SIZE)
+	{
+		s->setPosition(Position({ value, s->getAuthorId() }));
+	}
+
+	_text.setIndexed(indexed);
+
+	// Restore the block boundaries and list memberships with the new positions
+	for (QMap<TextBlockID, QPair<int, int>>::const_iterator i = bounds.constBegin(); i != bounds.constEnd(); i++)
+	{
+		TextBlock& b = _blocks[i.key()];
+		b.setBegin(_text[i.value().first].getPosition());
+		b.setEnd(_text[i.value().second].getPosition());
+
+		if (b.getListId())
+			_lists[b.getListId()].addBlock(b.getId(), b.begin());
+	}
+
+	rebuildBlockIndex();
+	_epoch++;
+}
+
+
+int Document::mergeFrom(const Document& other)
+{
+	if (other._epoch != _epoch)
+		return -1;		// (the positions of different epochs can't be compared)
+
+	// The tombstones of both replicas take part in the merge, so that a symbol deleted by either is deleted
+	QVector<Symbol> local = _text.toVector(true);
+	QVector<Symbol> remote = other._text.toVector(true);
+	QVector<Symbol> merged;
+	QVector<qint32> formatMap(other._formats.size(), -1);
+	int added = 0;
+
+	merged.reserve(local.size() + remote.size());
+
+	// Merge the two sorted sequences of symbols, the local copy of a symbol held by both is kept
+	// (unless only the remote one is a tombstone)
+	for (int a = 0, b = 0; a < local.size() || b < remote.size(); )
+	{
+		int cmp = a == local.size() ? 1 : b == remote.size() ? -1 : local[a].getPosition().compare(remote[b].getPosition());
+
+		if (cmp < 0 || (cmp == 0 && (local[a].isDeleted() || !remote[b].isDeleted())))
+		{
+			merged.append(local[a++]);
+			if (cmp == 0)
+				b++;
+		}
+		else
+		{
+			// Translate the format of the remote symbol to the local pool
+			Symbol s = remote[b++];
+			qint32& fmt = formatMap[s.getFormatIndex()];
+			if (fmt < 0)
+				fmt = _formats.intern(other._formats[s.getFormatIndex()]);
+
+			s.setFormatIndex(fmt);
+			merged.append(s);
+			if (cmp == 0)
+				a++;
+			else if (!s.isDeleted())
+				added++;
+		}
+	}
+
+	// (the tombstones are only kept if the document keeps its own)
+	if (!_lazyRemoval)
+		merged.erase(std::remove_if(merged.begin(), merged.end(), [](const Symbol& s) { return s.isDeleted(); }), merged.end());
+
+	// Partition the merged text in blocks, at the block ends of either replica: each end is
+	// assigned to the first block claiming it (local before remote) which isn't placed yet
+	QMap<TextBlockID, TextBlock> blocks;
+	QMap<Position, TextBlockID>::const_iterator localEnd = _blockEnds.constBegin();
+	QMap<Position, TextBlockID>::const_iterator remoteEnd = other._blockEnds.constBegin();
+	QTextBlockFormat previousFormat;
+	int begin = -1;
+
+	for (int i = 0; i < merged.size(); i++)
+	{
+		if (merged[i].isDeleted())
+			continue;		// (the blocks are made of the live symbols, a deleted block end joins its block to the next)
+		if (begin < 0)
+			begin = i;
+
+		const Position& pos = merged[i].getPosition();
+		TextBlockID candidates[2] = { nullptr, nullptr };
+
+		while (localEnd != _blockEnds.constEnd() && localEnd.key() < pos)
+			localEnd++;
+		while (remoteEnd != other._blockEnds.constEnd() && remoteEnd.key() < pos)
+			remoteEnd++;
+
+		if (localEnd != _blockEnds.constEnd() && localEnd.key() == pos)
+			candidates[0] = localEnd.value();
+		if (remoteEnd != other._blockEnds.constEnd() && remoteEnd.key() == pos)
+			candidates[1] = remoteEnd.value();
+
+		if (!candidates[0] && !candidates[1])
+			continue;		// (not the end of a block)
+
+		TextBlock block;
+		if (candidates[0] && !blocks.contains(candidates[0]))
+			block = _blocks.value(candidates[0]);
+		else if (candidates[1] && !blocks.contains(candidates[1]))
+			block = _blocks.contains(candidates[1]) ? _blocks.value(candidates[1]) : other._blocks.value(candidates[1]);
+		else
+		{
+			// Both blocks already end before, the paragraph gets a new one (like the previous paragraph)
+			block = TextBlock(_blockCounter++, merged[i].getAuthorId(), previousFormat);
+		}
+
+		block.setBegin(merged[begin].getPosition());
+		block.setEnd(pos);
+		blocks.insert(block.getId(), block);
+		previousFormat = block.getFormat();
+		begin = -1;
+	}
+
+	// Rebuild the lists (of either replica) from the blocks which still belong to them
+	QMap<TextListID, TextList> lists;
+	for (QMap<TextBlockID, TextBlock>::iterator b = blocks.begin(); b != blocks.end(); b++)
+	{
+		TextListID listId = b->getListId();
+		if (!listId)
+			continue;
+
+		if (!lists.contains(listId))
+		{
+			TextList list = _lists.value(listId, other._lists.value(listId));
+			lists.insert(listId, TextList(listId, list.getFormat()));
+		}
+
+		lists[listId].addBlock(b.key(), b->begin());
+	}
+
+	_text.assign(merged);
+	_blocks = blocks;
+	_lists = lists;
+	_blockCounter = qMax(_blockCounter, other._blockCounter);
+	_listCounter = qMax(_listCounter, other._listCounter);
+	rebuildBlockIndex();
+
+	return added;
+}
+
+
 int Document::editBlockList(TextBlockID blockId, TextListID listId, QTextListFormat fmt)
 {
 	// Early out if the operation refers to a non-existing block
@@ -431,7 +1382,7 @@ int Document::formatSymbol(const Position& fPos, QTextCharFormat fmt, int hint)
 			return -1;					// Early out if the symbol does not exist in the document
 	}
 
-	_text[pos].setFormat(fmt);		// replace the char format with the new one
+	_text.symbolAt(pos).setFormatIndex(_formats.intern(fmt));		// replace the char format with the new one
 	return pos;
 }
 
@@ -454,6 +1405,55 @@ int Document::formatList(TextListID id, QTextListFormat fmt)
 }
 
 
+/*********** CHAR FORMAT METHODS **********/
+
+
+qint32 Document::internCharFormat(const QTextCharFormat& fmt)
+{
+	return _formats.intern(fmt);
+}
+
+const QTextCharFormat& Document::getCharFormat(qint32 fmtIndex) const
+{
+	return _formats[fmtIndex];
+}
+
+QVector<QTextCharFormat> Document::exportCharFormats(QVector<Symbol>& symbols) const
+{
+	QVector<QTextCharFormat> fmts;
+	QHash<qint32, qint32> exported;		// document format index -> index in the exported table
+
+	for (Symbol& s : symbols)
+	{
+		QHash<qint32, qint32>::const_iterator i = exported.constFind(s.getFormatIndex());
+		if (i == exported.constEnd())
+		{
+			i = exported.insert(s.getFormatIndex(), fmts.size());
+			fmts.append(_formats[s.getFormatIndex()]);
+		}
+
+		s.setFormatIndex(i.value());
+	}
+
+	return fmts;
+}
+
+void Document::importCharFormats(QVector<Symbol>& symbols, const QVector<QTextCharFormat>& fmts)
+{
+	QVector<qint32> imported;		// index in the received table -> document format index
+	imported.reserve(fmts.size());
+
+	for (const QTextCharFormat& fmt : fmts)
+		imported.append(_formats.intern(fmt));
+
+	for (Symbol& s : symbols)
+	{
+		qint32 fmtIndex = s.getFormatIndex();
+		s.setFormatIndex(fmtIndex >= 0 && fmtIndex < imported.size() ? imported[fmtIndex] : CHARFORMAT_DEFAULT);
+	}
+}
+
+
 /*********** BLOCK METHODS **********/
 
 
@@ -470,15 +1470,19 @@ int Document::getBlockPosition(TextBlockID blockId)
 	else return -1;
 }
 
-TextBlockID Document::getBlockAt(int index)
+TextBlockID Document::getBlockAt(int index) const
 {
 	if (index < 0 || index >= _text.size())
 		throw std::out_of_range("The specified index is not a valid position for the document");
 
-	return _text[index].getBlockId();
+	// The symbol belongs to the first block which ends at (or after) its position
+	QMap<Position, TextBlockID>::const_iterator i = _blockEnds.lowerBound(_text[index].getPosition());
+	Q_ASSERT(i != _blockEnds.constEnd());
+
+	return i.value();
 }
 
-QList<TextBlockID> Document::getBlocksBetween(int start, int end)
+QList<TextBlockID> Document::getBlocksBetween(int start, int end) const
 {
 	QList<TextBlockID> result;
 
@@ -486,70 +1490,127 @@ QList<TextBlockID> Document::getBlocksBetween(int start, int end)
 	start = std::clamp<int>(start, 0, _text.size());
 	end = std::clamp<int>(end, 0, _text.size());
 
-	int n = start;
-	while (n < _text.size())
+	if (start >= _text.size())
+		return result;
+
+	// Walk the block boundaries from the block containing start, up to the block containing the last index
+	QMap<Position, TextBlockID>::const_iterator i = _blockEnds.lowerBound(_text[start].getPosition());
+	for (; i != _blockEnds.constEnd(); i++)
 	{
-		TextBlockID blockId = getBlockAt(n);
-		TextBlock& block = _blocks[blockId];	// Get the block and add it to the list of results
-		result.append(blockId);
-		n = findPosition(block.end()) + 1;		// Skip to the beginning of the next block
-		if (n <= 0 || n >= end)
-			break;	
+		result.append(i.value());
+		if (end <= 0 || !(i.key() < _text[end - 1].getPosition()))
+			break;
 	}
 
 	return result;
 }
 
 
-void Document::addCharToBlock(Symbol& s, TextBlock& b)
+bool Document::isInsideBlock(const SymbolEdit& e) const
 {
-	if (s.getBlockId() && s.getBlockId() != b.getId())
-	{
-		// Remove the char from any previous block it's in
-		removeCharFromBlock(s, _blocks[s.getBlockId()]);
-	}
+	const Position& fPos = e.symbol.getPosition();
+
+	if (e.type == SymbolEdit::Formatting)
+		return true;
+	if (e.type == SymbolEdit::Removal && !_lazyRemoval)
+		return false;		// (the physical removal may merge the chunks of the sequence)
+	if (e.type == SymbolEdit::Insertion && e.symbol.getChar() == QChar::ParagraphSeparator)
+		return false;
+
+	// The symbol must lie strictly between the first and the last symbol of its block
+	QMap<Position, TextBlockID>::const_iterator end = _blockEnds.lowerBound(fPos);
+	if (end == _blockEnds.constEnd() || end.key() == fPos)
+		return false;
+
+	QMap<TextBlockID, TextBlock>::const_iterator block = _blocks.constFind(end.value());
+	return block != _blocks.constEnd() && block->begin() < fPos;
+}
 
-	s.setBlock(b.getId());
 
+void Document::addCharToBlock(const Position& fPos, TextBlock& b)
+{
 	if (b.isEmpty())
 	{
-		b.setBegin(s.getPosition());	// set block delimiters
-		b.setEnd(s.getPosition());
+		setBlockBegin(b, fPos);	// set block delimiters
+		setBlockEnd(b, fPos);
 	}
-	else if (s.getPosition() < b.begin()) {
-		b.setBegin(s.getPosition());		 // update block begin
+	else if (fPos < b.begin()) {
+		setBlockBegin(b, fPos);	 // update block begin
 	}
-	else if (s.getPosition() > b.end()) {
-		b.setEnd(s.getPosition());			 // update block end
+	else if (fPos > b.end()) {
+		setBlockEnd(b, fPos);	 // update block end
 	}
 }
 
-void Document::removeCharFromBlock(Symbol& s, TextBlock& b)
+void Document::removeCharFromBlock(const Position& fPos, TextBlock& b)
 {
-	s.setBlock(nullptr);
-
-	if (s.getPosition() == b.begin() && s.getPosition() == b.end())
+	if (fPos == b.begin() && fPos == b.end())
 	{
 		// Completely remove the block when it's empty
-		if (b.getListId()) {
-			TextList& list = _lists[b.getListId()];
-			removeBlockFromList(b, list);
-		}
-		_blocks.remove(b.getId());
+		deleteBlock(b);
 	}
-	else if (s.getPosition() == b.begin())
+	else if (fPos == b.begin())
 	{
 		int beginIndex = findPosition(b.begin());
 		assert(beginIndex >= 0);
 
-		b.setBegin(_text[beginIndex + 1].getPosition());
+		setBlockBegin(b, _text[beginIndex + 1].getPosition());
 	}
-	else if (s.getPosition() == b.end())
+	else if (fPos == b.end())
 	{
 		int endIndex = findPosition(b.end());
 		assert(endIndex >= 0);
 
-		b.setEnd(_text[endIndex - 1].getPosition());
+		setBlockEnd(b, _text[endIndex - 1].getPosition());
+	}
+}
+
+
+void Document::setBlockBegin(TextBlock& b, const Position& fPos)
+{
+	// Move the block in the ordered blocks of its list
+	if (b.getListId())
+	{
+		QMap<TextListID, TextList>::iterator list = _lists.find(b.getListId());
+		if (list != _lists.end())
+			list->moveBlock(b.begin(), fPos);
+	}
+
+	b.setBegin(fPos);
+}
+
+void Document::setBlockEnd(TextBlock& b, const Position& fPos)
+{
+	// Move the block boundary in the index
+	QMap<Position, TextBlockID>::iterator i = _blockEnds.find(b.end());
+	if (i != _blockEnds.end() && i.value() == b.getId())
+		_blockEnds.erase(i);
+
+	b.setEnd(fPos);
+	_blockEnds.insert(fPos, b.getId());
+}
+
+void Document::deleteBlock(TextBlock& b)
+{
+	QMap<Position, TextBlockID>::iterator i = _blockEnds.find(b.end());
+	if (i != _blockEnds.end() && i.value() == b.getId())
+		_blockEnds.erase(i);
+
+	if (b.getListId()) {
+		TextList& list = _lists[b.getListId()];
+		removeBlockFromList(b, list);
+	}
+	_blocks.remove(b.getId());
+}
+
+void Document::rebuildBlockIndex()
+{
+	_blockEnds.clear();
+
+	for (QMap<TextBlockID, TextBlock>::const_iterator b = _blocks.constBegin(); b != _blocks.constEnd(); b++)
+	{
+		if (!b->isEmpty())
+			_blockEnds.insert(b->end(), b->getId());
 	}
 }
 
@@ -568,7 +1629,7 @@ int Document::getListPosition(TextListID listId)
 	// Returns the position of the first block in the list
 	QMap<TextListID, TextList>::iterator list = _lists.find(listId);
 	if (list != _lists.end())
-		return getBlockPosition(list->getBlocks().first());
+		return getBlockPosition(list->getFirstBlock());
 	else return -1;
 }
 
@@ -582,21 +1643,11 @@ TextListID Document::getListAt(int index)
 
 QList<TextBlockID> Document::getOrderedListBlocks(TextListID listId)
 {
-	QMap<Position, TextBlockID> ordered_blocks;
+	// The list keeps its blocks sorted by their position in the document
 	QMap<TextListID, TextList>::iterator list = _lists.find(listId);
-
 	if (list != _lists.end())
-	{
-		// Build an ordered map of the list blocks (sorted by their position in the document)
-		// in order to obtain an ordered list of blockIDs by calling .values()
-		foreach(TextBlockID blockId, list->getBlocks())
-		{
-			TextBlock& block = _blocks[blockId];
-			ordered_blocks.insert(block.begin(), blockId);
-		}
-	}
-
-	return ordered_blocks.values();
+		return list->getBlocks();
+	else return QList<TextBlockID>();
 }
 
 
@@ -609,13 +1660,13 @@ void Document::addBlockToList(TextBlock& b, TextList& l)
 	}
 
 	b.setList(l.getId());
-	l.addBlock(b.getId());
+	l.addBlock(b.getId(), b.begin());
 }
 
 void Document::removeBlockFromList(TextBlock& b, TextList& l)
 {
 	b.setList(nullptr);
-	l.removeBlock(b.getId());
+	l.removeBlock(b.getId(), b.begin());
 
 	if (l.isEmpty())
 	{
@@ -626,53 +1677,27 @@ void Document::removeBlockFromList(TextBlock& b, TextList& l)
 
 
 
-/************ BINARY SEARCH ALGORITHM *************/
+/************ POSITION SEARCH ALGORITHM *************/
 
 
-// Binary search, returns the index of the symbol at the specified fractional position
+// Tree search, returns the index of the symbol at the specified fractional position
 // otherwise returns -1 (if no symbol has that position) 
-int Document::findPosition(const Position& pos)
+int Document::findPosition(const Position& pos) const
 {
-	int lower = 0;
-	int higher = _text.size() - 1;
-	int m = 0;
-
-	while (lower <= higher)
-	{
-		m = std::floor((lower + higher) / 2);
-
-		if (_text[m].getPosition() == pos)	 // search hit
-			return m;
-		else if (_text[m].getPosition() < pos)
-			m = lower = m + 1;
-		else higher = m - 1;
-	}
-
-	return -1;		// no match found
+	return _text.indexOf(pos);
 }
 
 
-// Binary search, returns the index at which a new symbol with the specified fPos should be inserted
+// Tree search, returns the index at which a new symbol with the specified fPos should be inserted
 // otherwise returns -1 (if a symbol with that fractional position already exists) 
-int Document::insertionIndex(const Position& pos)
+int Document::insertionIndex(const Position& pos) const
 {
-	int lower = 0;
-	int higher = _text.size() - 1;
-	int m = 0;
-
-	while (lower <= higher)
-	{
-		m = std::floor((lower + higher) / 2);
+	int index = _text.lowerBound(pos);
 
-		if (_text[m].getPosition() == pos)
-			return -1;
-		else if (_text[m].getPosition() < pos)
-			m = lower = m + 1;
-		else  // _text[m].getPosition() > pos
-			higher = m - 1;
-	}
+	if (index < _text.size() && _text[index].getPosition().compare(pos) == 0)
+		return -1;
 
-	return m;		// the final index represents the insertion position
+	return index;		// the first symbol following pos is the insertion position
 }
 
 
@@ -681,13 +1706,20 @@ int Document::insertionIndex(const Position& pos)
 
 /* Generate a fractional position (an array of values) which should identify
  a new symbol inserted in the document at the specified index by a certain user */
-Position Document::newFractionalPos(int index, qint32 authorId)
+Position Document::newFractionalPos(int index, qint32 authorId) const
 {
-	QVector<qint32> result;
-
 	if (index < 0 || index > _text.size())
 		throw std::out_of_range("The specified index is not a valid position for the document");
 
+	if (_posStrategy == AdaptiveAllocation)
+		return adaptiveFractionalPos(index, authorId);
+	else return fixedGapFractionalPos(index, authorId);
+}
+
+Position Document::fixedGapFractionalPos(int index, qint32 authorId) const
+{
+	QVector<qint32> result;
+
 	if (_text.empty())		// First character in the document
 	{
 		result.push_back(0);
@@ -738,6 +1770,161 @@ Position Document::newFractionalPos(int index, qint32 authorId)
 	return Position(result);
 }
 
+/* Generate the positions of 'count' symbols which follow each other between prev and next (either of them
+ can be missing, at the ends of the document). They are allocated at the shallowest depth which can hold all
+ of them, and evenly spaced in it: a long paste does not make the positions deeper at every character */
+static QVector<Position> spreadPositions(const Position* prev, const Position* next, int count, qint32 authorId)
+{
+	QVector<Position> positions;
+	QVector<qint32> prefix;
+	bool boundedByPrev = prev != nullptr;		// (while the prefix is the same as that of the neighbour)
+	bool boundedByNext = next != nullptr;
+
+	positions.reserve(count);
+
+	for (int depth = 0; count > 0; depth++)
+	{
+		qint64 width = qint64(count + 1) * FPOS_GAP_SIZE;	  // (used when one side is unbounded)
+		bool hasLow = boundedByPrev && depth < prev->size();
+		bool hasHigh = boundedByNext && depth < next->size();
+		qint64 low, high;
+
+		if (hasLow && hasHigh) {
+			low = (*prev)[depth];
+			high = (*next)[depth];
+		}
+		else if (hasLow) {
+			low = (*prev)[depth];
+			high = std::min(low + width, qint64(INT_MAX) + 1);
+		}
+		else if (hasHigh) {
+			high = (*next)[depth];
+			low = std::max(high - width, qint64(INT_MIN) - 1);
+		}
+		else {
+			low = -1;
+			high = low + width;
+		}
+
+		if (high - low - 1 >= count)
+		{
+			// The gap can hold all the symbols: spread them evenly in it
+			qint64 step = (high - low) / (count + 1);
+			prefix.append(0);
+			prefix.append(authorId);		// User ID is added as part of the fractional position to ensure uniqueness
+
+			for (int n = 1; n <= count; n++)
+			{
+				prefix[depth] = qint32(low + n * step);
+				positions.append(Position(prefix));
+			}
+			break;
+		}
+
+		// Not enough room at this depth: go one level deeper, under a value of the gap
+		if (hasLow)
+		{
+			prefix.append(qint32(low));
+			if (low != high)
+				boundedByNext = false;
+		}
+		else if (high - low - 1 < 1)
+		{
+			prefix.append(qint32(high));		// (next is at INT_MIN at this depth: follow it, the run can precede it deeper)
+		}
+		else
+		{
+			prefix.append(qint32(low + 1));
+			boundedByPrev = false;
+			boundedByNext = false;
+		}
+	}
+
+	return positions;
+}
+
+/* Generate the positions of 'count' consecutive symbols inserted at the specified index: the first one is
+ allocated by the strategy of the document, and the following ones are spread in the gap which it leaves
+ before the next symbol */
+QVector<Position> Document::newFractionalPositions(int index, int count, qint32 authorId) const
+{
+	QVector<Position> positions;
+
+	if (count <= 0)
+		return positions;
+
+	Position first = newFractionalPos(index, authorId);
+	const Position* next = index < _text.size() ? &_text[index].getPosition() : nullptr;
+
+	positions.reserve(count);
+	positions.append(first);
+	positions.append(spreadPositions(&first, next, count - 1, authorId));
+
+	return positions;
+}
+
+/* Adaptive allocation (LSEQ): at every depth the new value is picked close to one of the two neighbours, within
+ FPOS_BOUNDARY of the previous symbol (boundary+, even depths) or of the next one (boundary-, odd depths), so that
+ both typing forward and typing backward leave room for the following insertions at the same depth. A missing
+ neighbour leaves that side unbounded, and the interval takes the width of a base which doubles at each depth */
+Position Document::adaptiveFractionalPos(int index, qint32 authorId) const
+{
+	QVector<qint32> result;
+
+	const Position* prev = index > 0 ? &_text[index - 1].getPosition() : nullptr;	  // The symbols which 'sandwich' the insertion position
+	const Position* next = index < _text.size() ? &_text[index].getPosition() : nullptr;
+	bool boundedByNext = next != nullptr;		// (until the new position departs from the prefix of next)
+
+	for (int depth = 0; ; depth++)
+	{
+		qint64 base = qint64(FPOS_BASE_SIZE) << std::min(depth, FPOS_MAX_BASE_SHIFT);
+		bool hasLow = prev != nullptr && depth < prev->size();
+		bool hasHigh = boundedByNext && depth < next->size();
+		qint64 low, high;		// (exclusive bounds of the values available at this depth)
+
+		if (hasLow && hasHigh) {
+			low = (*prev)[depth];
+			high = (*next)[depth];
+		}
+		else if (hasLow) {
+			low = (*prev)[depth];
+			high = std::min(low + base, qint64(INT_MAX) + 1);
+		}
+		else if (hasHigh) {
+			high = (*next)[depth];
+			low = std::max(high - base, qint64(INT_MIN) - 1);
+		}
+		else {
+			low = -1;
+			high = base;
+		}
+
+		qint64 gap = high - low - 1;
+		if (gap < 1 && hasLow)
+		{
+			// No room at this depth: follow the previous symbol and go one level deeper
+			result.push_back(qint32(low));
+			if (low != high)
+				boundedByNext = false;
+			continue;
+		}
+		else if (gap < 1)
+		{
+			// The next symbol is at INT_MIN at this depth, and there is no lower value: follow it
+			// and go one level deeper, where the new position can precede it
+			result.push_back(qint32(high));
+			continue;
+		}
+
+		qint32 step = 1 + QRandomGenerator::global()->bounded(qint32(std::min<qint64>(gap, FPOS_BOUNDARY)));
+		result.push_back(qint32(depth % 2 == 0 ? low + step : high - step));
+		break;
+	}
+
+	result.push_back(authorId);		// User ID is added as part of the fractional position to ensure uniqueness
+	return Position(result);
+}
+
 
 
 /********* SERIALIZATION OPERATORS **********/
@@ -746,8 +1933,13 @@ Position Document::newFractionalPos(int index, qint32 authorId)
 QDataStream& operator>>(QDataStream& in, Document& doc)		// Input
 {
 	// Deserialization
+	qint32 strategy;
+
 	in >> doc.uri >> doc._blockCounter >> doc._blocks 
-		>> doc._listCounter >> doc._lists >> doc._text;
+		>> doc._listCounter >> doc._lists >> strategy >> doc._epoch >> doc._formats >> doc._text;
+
+	doc._posStrategy = PositionStrategy(strategy);
+	doc.rebuildBlockIndex();
 
 	return in;
 }
@@ -756,7 +1948,7 @@ QDataStream& operator<<(QDataStream& out, const Document& doc)		// Output
 {
 	// Serialization
 	out << doc.uri << doc._blockCounter << doc._blocks 
-		<< doc._listCounter << doc._lists << doc._text;
+		<< doc._listCounter << doc._lists << qint32(doc._posStrategy) << doc._epoch << doc._formats << doc._text;
 
 	return out;
 }
@@ -1,8 +1,11 @@
 #pragma once
 
 #include <QString>
+#include <QSharedPointer>
 
+#include "CharFormatPool.h"
 #include "Symbol.h"
+#include "SymbolSequence.h"
 #include "TextBlock.h"
 #include "TextList.h"
 
@@ -11,6 +14,7 @@
 #define URI_FIELD_SEPARATOR	"_"	
 #define MAX_DOCNAME_LENGTH 100		// characters
 #define DOCUMENTS_DIRNAME "./Documents/"	// Path on which the document files are stored (on the server)
+#define PAGES_FILE_EXTENSION ".pages"		// File of the pages of a document, listed by the directory in the document file
 
 
 class URI
@@ -44,6 +48,17 @@ public:
 Q_DECLARE_METATYPE(URI);
 
 
+/* Algorithms which can be used by a document to allocate the fractional positions of new symbols */
+enum PositionStrategy : qint32
+{
+	FixedGapAllocation,		// middle value, or a new level at a fixed gap from the previous symbol
+	AdaptiveAllocation		// LSEQ-like: boundary+/boundary- alternated by depth, with a base growing at each depth
+};
+
+
+struct DocumentPages;		// (pages of the document already written to disk, see Document.cpp)
+
+
 class Document
 {
 	friend class DocumentEditor;
@@ -56,31 +71,77 @@ private:
 
 	URI uri;
 
-	QVector<Symbol> _text;
+	SymbolSequence _text;
+	CharFormatPool _formats;		// distinct char formats, referenced by index from the symbols
 
 	qint32 _blockCounter;
 	QMap<TextBlockID, TextBlock> _blocks;
+	QMap<Position, TextBlockID> _blockEnds;		// ordered index of the block boundaries (end position -> block)
 
 	qint32 _listCounter;
 	QMap<TextListID, TextList> _lists;
 
+	PositionStrategy _posStrategy;		// (chosen when the document is created, stored with it)
+	quint32 _epoch;						// incremented each time the positions are compacted
+	bool _lazyRemoval;					// removed symbols are left as tombstones (until purged)
+	int _editThreads;					// threads which apply a batch of edits to the segments of the text
+	quint32 _journal;					// number of the journal of the edits which follow the contents (saved in the file)
+	int _compression;					// zlib level of the pages written by save (0: uncompressed)
+	QSharedPointer<DocumentPages> _pages;		// (shared with the snapshots, the last save of any of them is the one on disk)
+
 public:
 
 	Document();		// Only use to construct an empty Document object for deserialization purposes
 
-	Document(URI uri, qint32 authorId = -1);
+	Document(URI uri, qint32 authorId = -1, PositionStrategy strategy = AdaptiveAllocation);
 	~Document();
 
 	/* File methods */
-	void load();
+	void load();		// (and replays the journals which follow the contents of the file)
 	void unload();
-	void save();
+	void save();		// only writes the pages changed since the last save (and nothing if the document is unchanged)
 	void erase();
 
+	/* Journal methods */
+	QString getJournalName() const;		// file of the journal which receives the edits following the current contents
+	void beginJournal();				// (checkpoint) the following edits go to a new journal, which the saved contents precede
+	void removeOldJournals();			// deletes the journals which precede the current one (once the contents are saved)
+
+	Document snapshot() const;		// frozen copy of the contents, which shares the chunks of the text (copy-on-write)
+
 	/* Editing methods */
 	int insert(Symbol& s, int positionHint = -1);
+	QList<QPair<int, int>> insertRange(QVector<Symbol>& symbols);		// returns the (start, count) ranges of inserted symbols
 	int remove(const Position& fPos, int positionHint = -1);
 	Position removeAtIndex(int index);
+	int removeRange(int from, int count);		// returns the number of removed symbols
+	QList<QPair<int, int>> removeRange(QVector<Position> positions);		// returns the (start, count) ranges, in removal order
+
+	void compactPositions();		// renumbers all the positions to a dense sequence of one level, starting a new epoch
+
+	// Merges another replica of the document in a single pass over both: the symbols of either are kept, except
+	// the ones which either holds as tombstones (the symbols purged from a replica can't be told from the ones it
+	// never had). Returns the number of symbols added (or -1 if the replica positions belong to another epoch)
+	int mergeFrom(const Document& other);
+
+	/* Tombstones */
+	void setLazyRemoval(bool enabled);
+	int tombstones() const;
+	void purgeTombstones();			// physically removes the deleted symbols (does not change the contents)
+
+	/* Position index */
+	void setPositionIndex(bool enabled);		// symbols are located by position through a hash table
+
+	/* Storage */
+	void setCompression(int level);		// the pages of the file written from now on are compressed with that zlib level (0: none)
+	void packText();		// encodes the chunks of the text in spans while it is idle (they are decoded again when accessed)
+
+	/* Batches of edits */
+	void setEditThreads(int nThreads);		// edits to different segments of the text are applied on up to nThreads threads
+
+	// Applies the edits in order, returns the number of those which had effect (the ones which leave
+	// the blocks unchanged are applied together, the others one at a time in between)
+	int applyEdits(QVector<SymbolEdit> edits);
 
 	int editBlockList(TextBlockID bId, TextListID lId, QTextListFormat fmt);
 	int formatSymbol(const Position& fPos, QTextCharFormat fmt, int positionHint = -1);
@@ -88,6 +149,16 @@ public:
 	int formatList(TextListID id, QTextListFormat fmt);
 	
 
+	/* Char format methods */
+	qint32 internCharFormat(const QTextCharFormat& fmt);
+	const QTextCharFormat& getCharFormat(qint32 fmtIndex) const;
+
+	// Translate the format indexes of a batch of symbols from/to a table which only holds
+	// the formats used in the batch (as carried by a CharsInsert message)
+	QVector<QTextCharFormat> exportCharFormats(QVector<Symbol>& symbols) const;
+	void importCharFormats(QVector<Symbol>& symbols, const QVector<QTextCharFormat>& fmts);
+
+
 	/* Getters */
 	URI getURI() const;
 	QString getName() const;
@@ -96,6 +167,11 @@ public:
 	int length() const;
 	QVector<Symbol> getContent() const;
 	QString toString() const;				// returns a printable representation of the document's contents
+	bool hasSameContents(const Document& other) const;		// same chars and formats of chars, blocks and lists (whatever their positions)
+
+	PositionStrategy getPositionStrategy() const;
+	quint32 getEpoch() const;
+	QPair<double, int> getPositionDepth() const;		// average and maximum number of levels of the positions
 
 	// The [] array operator works with both indexes and fractional positions, and it
 	// returns the corresponding symbols in the document
@@ -105,8 +181,8 @@ public:
 	/* Block accessor methods */
 	TextBlock& getBlock(TextBlockID id);
 	int getBlockPosition(TextBlockID blockId);
-	TextBlockID getBlockAt(int index);
-	QList<TextBlockID> getBlocksBetween(int start, int end);
+	TextBlockID getBlockAt(int index) const;
+	QList<TextBlockID> getBlocksBetween(int start, int end) const;
 
 	/* List accessor methods */
 	TextList& getList(TextListID id);
@@ -117,16 +193,30 @@ public:
 
 private:
 
-	/* Binary search method to translate: fractional position <-> integer index */
-	int findPosition(const Position& pos);
-	int insertionIndex(const Position& pos);
+	void readBaseline(QDataStream& in);		// (contents of a document file saved before the char formats were pooled)
+
+	/* Search methods to translate: fractional position <-> integer index */
+	int findPosition(const Position& pos) const;
+	int insertionIndex(const Position& pos) const;
 
 	/* Fractional position algorithm */
-	Position newFractionalPos(int index, qint32 _userId);
+	Position newFractionalPos(int index, qint32 _userId) const;
+	QVector<Position> newFractionalPositions(int index, int count, qint32 authorId) const;	// (for a run of new symbols)
+	Position fixedGapFractionalPos(int index, qint32 authorId) const;
+	Position adaptiveFractionalPos(int index, qint32 authorId) const;
+
+	bool readPages(QDataStream& in);		// (from the directory in the document file) returns false if any page is missing or corrupt
+	QString getPagesName(quint32 generation) const;
+	void removeFiles(const QString& extension, quint32 before, const QString& except = QString());		// deletes the journal (or pages) files numbered below that one
 
 	// Internal handling of chars and blocks relationships
-	void addCharToBlock(Symbol& s, TextBlock& b);
-	void removeCharFromBlock(Symbol& s, TextBlock& b);
+	bool isInsideBlock(const SymbolEdit& e) const;		// the edit changes neither the boundaries nor the number of blocks
+	void addCharToBlock(const Position& fPos, TextBlock& b);
+	void removeCharFromBlock(const Position& fPos, TextBlock& b);
+	void setBlockBegin(TextBlock& b, const Position& fPos);
+	void setBlockEnd(TextBlock& b, const Position& fPos);
+	void deleteBlock(TextBlock& b);
+	void rebuildBlockIndex();		// (after the blocks are loaded)
 
 	// Internal handling of blocks and lists relationships
 	void addBlockToList(TextBlock& b, TextList& l);
@@ -0,0 +1,255 @@
+#include "DocumentJournal.h"
+#include "Document.h"
+
+#include <QDataStream>
+
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+
+/*************** DOCUMENTJOURNAL CLASS ***************/
+
+DocumentJournal::DocumentJournal()
+	: _size(0)
+{
+}
+
+DocumentJournal::~DocumentJournal()
+{
+	close();
+}
+
+
+void DocumentJournal::open(const QString& fileName)
+{
+	close();
+
+	_file.setFileName(fileName);
+	_file.open(QIODevice::WriteOnly | QIODevice::Append);		// (the file is created even if no record is ever written)
+	_size = _file.size();
+}
+
+void DocumentJournal::close()
+{
+	if (!_file.isOpen())
+		return;
+
+	commit();
+	_file.close();
+	_size = 0;
+}
+
+bool DocumentJournal::isOpen() const
+{
+	return _file.isOpen();
+}
+
+bool DocumentJournal::hasPending() const
+{
+	return !_pending.isEmpty();
+}
+
+qint64 DocumentJournal::size() const
+{
+	return _size;
+}
+
+
+void DocumentJournal::append(const QByteArray& record)
+{
+	QByteArray frame;
+	QDataStream out(&frame, QIODevice::WriteOnly);
+
+	// Each record is preceded by its size and checksum
+	out << quint32(record.size()) << qChecksum(record.constData(), uint(record.size()));
+	frame.append(record);
+
+	_pending.append(frame);
+	_size += frame.size();
+}
+
+void DocumentJournal::recordInsert(const QVector<Symbol>& symbols, const QVector<QTextCharFormat>& charFmts,
+	TextBlockID blockId, const QTextBlockFormat& blockFmt)
+{
+	QByteArray record;
+	QDataStream out(&record, QIODevice::WriteOnly);
+
+	out << qint32(CharsInsert) << symbols << charFmts << blockId << blockFmt;
+	append(record);
+}
+
+void DocumentJournal::recordDelete(const QVector<Position>& positions)
+{
+	QByteArray record;
+	QDataStream out(&record, QIODevice::WriteOnly);
+
+	out << qint32(CharsDelete) << positions;
+	append(record);
+}
+
+void DocumentJournal::recordFormat(const QVector<Position>& positions, const QVector<QTextCharFormat>& formats)
+{
+	QByteArray record;
+	QDataStream out(&record, QIODevice::WriteOnly);
+
+	out << qint32(CharsFormat) << positions << formats;
+	append(record);
+}
+
+void DocumentJournal::recordBlockEdit(TextBlockID blockId, const QTextBlockFormat& format)
+{
+	QByteArray record;
+	QDataStream out(&record, QIODevice::WriteOnly);
+
+	out << qint32(BlockEdit) << blockId << format;
+	append(record);
+}
+
+void DocumentJournal::recordListEdit(TextBlockID blockId, TextListID listId, const QTextListFormat& format)
+{
+	QByteArray record;
+	QDataStream out(&record, QIODevice::WriteOnly);
+
+	out << qint32(ListEdit) << blockId << listId << format;
+	append(record);
+}
+
+void DocumentJournal::recordCompaction()
+{
+	QByteArray record;
+	QDataStream out(&record, QIODevice::WriteOnly);
+
+	out << qint32(Compaction);
+	append(record);
+}
+
+
+bool DocumentJournal::commit()
+{
+	if (_pending.isEmpty())
+		return true;
+
+	// All the records of the group are written, and synced, at once
+	bool written = _file.write(_pending) == _pending.size();
+	_pending.clear();
+
+	return written && syncToDisk(_file);
+}
+
+bool DocumentJournal::syncToDisk(QFile& file)
+{
+	if (!file.flush())
+		return false;
+
+#ifdef Q_OS_WIN
+	return _commit(file.handle()) == 0;
+#else
+	return fsync(file.handle()) == 0;
+#endif
+}
+
+
+int DocumentJournal::replay(const QString& fileName, Document& doc)
+{
+	QFile file(fileName);
+	if (!file.open(QIODevice::ReadOnly | QIODevice::ExistingOnly))
+		return -1;
+
+	QDataStream in(&file);
+	int count = 0;
+
+	while (!in.atEnd())
+	{
+		quint32 size;
+		quint16 checksum;
+		in >> size >> checksum;
+
+		// The last record may have been torn by a crash while it was written
+		QByteArray record(int(qMin<quint32>(size, quint32(file.bytesAvailable()))), Qt::Uninitialized);
+		if (in.status() != QDataStream::Ok || quint32(record.size()) != size ||
+			in.readRawData(record.data(), record.size()) != record.size() ||
+			qChecksum(record.constData(), uint(record.size())) != checksum)
+		{
+			break;
+		}
+
+		QDataStream recordStream(record);
+		qint32 type;
+		recordStream >> type;
+
+		apply(RecordType(type), recordStream, doc);
+		count++;
+	}
+
+	return count;
+}
+
+void DocumentJournal::apply(RecordType type, QDataStream& in, Document& doc)
+{
+	switch (type)
+	{
+	case CharsInsert:
+	{
+		QVector<Symbol> symbols;
+		QVector<QTextCharFormat> charFmts;
+		TextBlockID blockId;
+		QTextBlockFormat blockFmt;
+
+		in >> symbols >> charFmts >> blockId >> blockFmt;
+		doc.importCharFormats(symbols, charFmts);
+		doc.insertRange(symbols);
+		if (blockId)
+			doc.formatBlock(blockId, blockFmt);
+		break;
+	}
+
+	case CharsDelete:
+	{
+		QVector<Position> positions;
+
+		in >> positions;
+		doc.removeRange(positions);
+		break;
+	}
+
+	case CharsFormat:
+	{
+		QVector<Position> positions;
+		QVector<QTextCharFormat> formats;
+		int hint = -1;
+
+		in >> positions >> formats;
+		for (int i = 0; i < positions.size() && i < formats.size(); i++)
+			hint = doc.formatSymbol(positions[i], formats[i], hint);
+		break;
+	}
+
+	case BlockEdit:
+	{
+		TextBlockID blockId;
+		QTextBlockFormat format;
+
+		in >> blockId >> format;
+		doc.formatBlock(blockId, format);
+		break;
+	}
+
+	case ListEdit:
+	{
+		TextBlockID blockId;
+		TextListID listId;
+		QTextListFormat format;
+
+		in >> blockId >> listId >> format;
+		doc.editBlockList(blockId, listId, format);
+		break;
+	}
+
+	case Compaction:
+		doc.compactPositions();
+		break;
+	}
+}
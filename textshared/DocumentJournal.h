@@ -0,0 +1,76 @@
+#pragma once
+
+#include <QFile>
+#include <QByteArray>
+#include <QVector>
+#include <QTextCharFormat>
+#include <QTextBlockFormat>
+#include <QTextListFormat>
+
+#include "Symbol.h"
+#include "TextBlock.h"
+#include "TextList.h"
+
+#define JOURNAL_FILE_EXTENSION ".journal"
+
+class Document;
+
+
+/************* DOCUMENTJOURNAL CLASS *************/
+
+/* Append-only file of the edits applied to a document after its contents were last saved (checkpoint).
+   Records are buffered and written together with a single sync of the file (group commit), each one
+   framed by its size and checksum, so that a record torn by a crash is detected and dropped on replay.
+   Journals are numbered: the document file stores the number of the first journal which follows its
+   contents, and the older ones are deleted once a new checkpoint has been saved */
+
+class DocumentJournal
+{
+public:
+
+	enum RecordType : qint32
+	{
+		CharsInsert,
+		CharsDelete,
+		CharsFormat,
+		BlockEdit,
+		ListEdit,
+		Compaction		// (the renumbering of the positions only depends on the contents, it is replayed as well)
+	};
+
+private:
+
+	QFile _file;
+	QByteArray _pending;		// framed records which have not been committed yet
+	qint64 _size;				// bytes of the journal, including the pending records
+
+	void append(const QByteArray& record);
+	static void apply(RecordType type, QDataStream& in, Document& doc);
+
+public:
+
+	DocumentJournal();
+	~DocumentJournal();
+
+	void open(const QString& fileName);		// closes the current journal, and opens (or creates) another one for appending
+	void close();
+
+	bool isOpen() const;
+	bool hasPending() const;
+	qint64 size() const;
+
+	/* Records of the edits (buffered until the next commit) */
+	void recordInsert(const QVector<Symbol>& symbols, const QVector<QTextCharFormat>& charFmts, TextBlockID blockId, const QTextBlockFormat& blockFmt);
+	void recordDelete(const QVector<Position>& positions);
+	void recordFormat(const QVector<Position>& positions, const QVector<QTextCharFormat>& formats);
+	void recordBlockEdit(TextBlockID blockId, const QTextBlockFormat& format);
+	void recordListEdit(TextBlockID blockId, TextListID listId, const QTextListFormat& format);
+	void recordCompaction();
+
+	bool commit();		// writes the pending records and syncs the file to disk, returns false if it failed
+
+	static bool syncToDisk(QFile& file);		// (flushes the buffers of the file, and waits until its data is on disk)
+
+	// Applies the records of a journal file to the document, returns their number (or -1 if the file doesn't exist)
+	static int replay(const QString& fileName, Document& doc);
+};
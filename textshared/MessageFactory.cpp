@@ -140,19 +140,19 @@ MessageCapsule MessageFactory::DocumentError(QString error)
 	return new DocumentErrorMessage(error);
 }
 
-MessageCapsule MessageFactory::CharsInsert(QVector<Symbol> symbols, bool isLast, TextBlockID bId, QTextBlockFormat blkFmt)
+MessageCapsule MessageFactory::CharsInsert(QVector<Symbol> symbols, QVector<QTextCharFormat> charFmts, bool isLast, TextBlockID bId, QTextBlockFormat blkFmt, quint32 epoch)
 {
-	return new CharsInsertMessage(symbols, isLast, bId, blkFmt);
+	return new CharsInsertMessage(symbols, charFmts, isLast, bId, blkFmt, epoch);
 }
 
-MessageCapsule MessageFactory::CharsDelete(QVector<Position> positions)
+MessageCapsule MessageFactory::CharsDelete(QVector<Position> positions, quint32 epoch)
 {
-	return new CharsDeleteMessage(positions);
+	return new CharsDeleteMessage(positions, epoch);
 }
 
-MessageCapsule MessageFactory::CharsFormat(QVector<Position> positions, QVector<QTextCharFormat> fmts)
+MessageCapsule MessageFactory::CharsFormat(QVector<Position> positions, QVector<QTextCharFormat> fmts, quint32 epoch)
 {
-	return new CharsFormatMessage(positions, fmts);
+	return new CharsFormatMessage(positions, fmts, epoch);
 }
 
 MessageCapsule MessageFactory::BlockEdit(TextBlockID blockId, QTextBlockFormat fmt)
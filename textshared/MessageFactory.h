@@ -34,9 +34,9 @@ public:
 	static MessageCapsule DocumentExit();
 	static MessageCapsule DocumentError(QString error);
 
-	static MessageCapsule CharsInsert(QVector<Symbol> symbols, bool isLast, TextBlockID bId, QTextBlockFormat blkFmt);
-	static MessageCapsule CharsDelete(QVector<Position> positions);
-	static MessageCapsule CharsFormat(QVector<Position> positions, QVector<QTextCharFormat> fmts);
+	static MessageCapsule CharsInsert(QVector<Symbol> symbols, QVector<QTextCharFormat> charFmts, bool isLast, TextBlockID bId, QTextBlockFormat blkFmt, quint32 epoch);
+	static MessageCapsule CharsDelete(QVector<Position> positions, quint32 epoch);
+	static MessageCapsule CharsFormat(QVector<Position> positions, QVector<QTextCharFormat> fmts, quint32 epoch);
 	static MessageCapsule BlockEdit(TextBlockID blockId, QTextBlockFormat fmt);
 	static MessageCapsule ListEdit(TextBlockID blockId, TextListID listId, QTextListFormat fmt);
 
@@ -2,23 +2,25 @@
 
 #include <QDataStream>
 
+#include <utility>
+
 
 /*************** SYMBOL METHODS ***************/
 
 Symbol::Symbol()
-	: _blockRef(nullptr)
+	: _deleted(false), _format(CHARFORMAT_DEFAULT), _blockRef(nullptr)
 {
 }
 
-Symbol::Symbol(QChar sym, QTextCharFormat fmt, Position fractionPos)
-	: _char(sym), _format(fmt), _fPos(fractionPos), _blockRef(nullptr)
+Symbol::Symbol(QChar sym, qint32 fmtIndex, Position fractionPos)
+	: _char(sym), _deleted(false), _format(fmtIndex), _fPos(std::move(fractionPos)), _blockRef(nullptr)
 {
 }
 
 
-void Symbol::setFormat(QTextCharFormat fmt)
+void Symbol::setFormatIndex(qint32 fmtIndex)
 {
-	_format = fmt;
+	_format = fmtIndex;
 }
 
 void Symbol::setBlock(TextBlockID blockId)
@@ -26,13 +28,18 @@ void Symbol::setBlock(TextBlockID blockId)
 	_blockRef = blockId;
 }
 
+void Symbol::setPosition(const Position& fPos)
+{
+	_fPos = fPos;
+}
+
 
 QChar Symbol::getChar() const
 {
 	return _char;
 }
 
-QTextCharFormat Symbol::getFormat() const
+qint32 Symbol::getFormatIndex() const
 {
 	return _format;
 }
@@ -52,6 +59,11 @@ qint32 Symbol::getAuthorId() const
 	return _fPos.getAuthorId();
 }
 
+bool Symbol::isDeleted() const
+{
+	return _deleted;
+}
+
 
 /*************** SERIALIZATION OPERATORS ***************/
 
@@ -1,7 +1,7 @@
 #pragma once
 
 #include <QChar>
-#include <QTextCharFormat>
+#include "CharFormatPool.h"
 #include "TextUtils.h"
 
 
@@ -11,30 +11,36 @@ class Symbol
 	friend QDataStream& operator>>(QDataStream& in, Symbol& sym);				// Input
 	friend QDataStream& operator<<(QDataStream& out, const Symbol& sym);		// Output
 
+	friend class SymbolSequence;		// (marks the tombstones)
+
 private:
 
 	QChar _char;
-	QTextCharFormat _format;
+	bool _deleted;			// tombstone, not yet reclaimed from the sequence (never serialized)
+	qint32 _format;			// index of the char format in the document's CharFormatPool
 	Position _fPos;
-	TextBlockID _blockRef;
+	TextBlockID _blockRef;		// (only meaningful in messages, the document derives it from the block boundaries)
 
 public:
 
 	Symbol();		// Constructs an empty Symbol (for deserialization purposes only)
 
-	Symbol(QChar sym, QTextCharFormat fmt, Position fractionPos);
+	Symbol(QChar sym, qint32 fmtIndex, Position fractionPos);
 
 
 	/* setters */
-	void setFormat(QTextCharFormat fmt);
+	void setFormatIndex(qint32 fmtIndex);
 	void setBlock(TextBlockID blockId);
+	void setPosition(const Position& fPos);		// (only when the positions of a document are renumbered)
 
 	/* getters */
 	QChar getChar() const;
-	QTextCharFormat getFormat() const;
+	qint32 getFormatIndex() const;
 	const Position& getPosition() const;
 	TextBlockID getBlockId() const;
 	qint32 getAuthorId() const;
+	bool isDeleted() const;
 };
 
 Q_DECLARE_METATYPE(Symbol);
+Q_DECLARE_TYPEINFO(Symbol, Q_MOVABLE_TYPE);		// (relocated with memmove inside the chunks of the SymbolSequence)
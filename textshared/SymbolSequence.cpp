@@ -0,0 +1,2131 @@
+#include "SymbolSequence.h"
+
+#include <QDataStream>
+#include <QtAlgorithms>
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QSemaphore>
+
+#include <algorithm>
+#include <climits>
+#include <utility>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SEQUENCE_SIMD_SSE2
+#endif
+
+
+/*************** COLUMN SCANS ***************/
+
+
+// Returns the index of the first occurrence of c in the column (or n if it's not found)
+static int findChar(const ushort* chars, int n, ushort c)
+{
+	int i = 0;
+
+#if defined(SEQUENCE_SIMD_SSE2)
+	__m128i vc = _mm_set1_epi16(short(c));
+	for (; i + 8 <= n; i += 8)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(chars + i));
+		quint32 match = quint32(_mm_movemask_epi8(_mm_cmpeq_epi16(v, vc)));
+		if (match)
+			return i + qCountTrailingZeroBits(match) / 2;
+	}
+#endif
+
+	for (; i < n; i++)
+	{
+		if (chars[i] == c)
+			return i;
+	}
+
+	return n;
+}
+
+// Returns the index of the first value of the column which is different from v (or n if there is none)
+static int findOther(const qint32* values, int n, qint32 v)
+{
+	int i = 0;
+
+#if defined(SEQUENCE_SIMD_SSE2)
+	__m128i vv = _mm_set1_epi32(v);
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i));
+		quint32 mismatch = ~quint32(_mm_movemask_epi8(_mm_cmpeq_epi32(x, vv))) & 0xFFFF;
+		if (mismatch)
+			return i + qCountTrailingZeroBits(mismatch) / 4;
+	}
+#endif
+
+	for (; i < n; i++)
+	{
+		if (values[i] != v)
+			return i;
+	}
+
+	return n;
+}
+
+
+// Returns the number of symbols which are not tombstones
+static int liveCount(const QVector<Symbol>& symbols)
+{
+	return int(std::count_if(symbols.begin(), symbols.end(), [](const Symbol& s) { return !s.isDeleted(); }));
+}
+
+
+/*************** TREE NODES ***************/
+
+
+SymbolSequence::Node::Node(bool leaf)
+	: count(0), isLeaf(leaf), parent(nullptr), compressed(false), levels(0), depth(0)
+{
+}
+
+SymbolSequence::Node::~Node()
+{
+	qDeleteAll(children);
+}
+
+SymbolSequence::Node* SymbolSequence::Node::clone() const
+{
+	Node* copy = new Node(isLeaf);
+	copy->count = count;
+	copy->chars = chars;
+	copy->authors = authors;
+	copy->symbols = symbols;		// (implicitly shared, until either chunk is modified)
+	copy->page = page;
+	copy->compressed = compressed;
+	copy->head = head;
+	copy->levels = levels;
+	copy->depth = depth;
+
+	for (Node* child : children)
+	{
+		copy->children.append(child->clone());
+		copy->children.last()->parent = copy;
+	}
+
+	return copy;
+}
+
+
+void SymbolSequence::Node::insertSymbol(int index, const Symbol& s)
+{
+	symbols.insert(index, s);
+	chars.insert(index, s.getChar());
+	authors.insert(index, s.getAuthorId());
+}
+
+void SymbolSequence::Node::removeSymbol(int index)
+{
+	symbols.removeAt(index);
+	chars.removeAt(index);
+	authors.removeAt(index);
+}
+
+void SymbolSequence::Node::refreshColumns()
+{
+	chars.resize(symbols.size());
+	authors.resize(symbols.size());
+
+	for (int i = 0; i < symbols.size(); i++)
+	{
+		chars[i] = symbols[i].getChar();
+		authors[i] = symbols[i].getAuthorId();
+	}
+}
+
+int SymbolSequence::Node::physicalIndex(int index) const
+{
+	if (count == symbols.size())
+		return index;		// (no tombstones in the leaf)
+
+	int slot = 0;
+	for (; slot < symbols.size(); slot++)
+	{
+		if (!symbols[slot].isDeleted() && index-- == 0)
+			break;
+	}
+
+	return slot;
+}
+
+int SymbolSequence::Node::liveIndex(int slot) const
+{
+	if (count == symbols.size())
+		return slot;
+
+	int index = 0;
+	for (int i = 0; i < slot; i++)
+	{
+		if (!symbols[i].isDeleted())
+			index++;
+	}
+
+	return index;
+}
+
+
+/*************** SEQUENCE METHODS ***************/
+
+
+SymbolSequence::SymbolSequence()
+	: root(new Node(true)), _tombstones(0), _arena(new PositionArena), _indexed(false)
+{
+}
+
+// The copy shares the chunks and the arena of the other sequence, but not its position index
+SymbolSequence::SymbolSequence(const SymbolSequence& other)
+	: root(other.root->clone()), _tombstones(other._tombstones), _arena(other._arena), _mapped(other._mapped), _indexed(false)
+{
+}
+
+SymbolSequence::~SymbolSequence()
+{
+	delete root;
+}
+
+SymbolSequence& SymbolSequence::operator=(const SymbolSequence& other)
+{
+	if (this != &other)
+	{
+		Node* copy = other.root->clone();
+		delete root;
+		root = copy;
+		_arena = other._arena;
+		_mapped = other._mapped;
+		_tombstones = other._tombstones;
+
+		_locations.clear();
+		if (_indexed)
+			reindex(root);
+	}
+
+	return *this;
+}
+
+
+int SymbolSequence::size() const
+{
+	return root->count;
+}
+
+bool SymbolSequence::isEmpty() const
+{
+	return root->count == 0;
+}
+
+bool SymbolSequence::empty() const
+{
+	return root->count == 0;
+}
+
+
+const Symbol& SymbolSequence::operator[](int index) const
+{
+	Node* leaf = leafAt(index);
+	return leaf->symbols.at(leaf->physicalIndex(index));
+}
+
+Symbol& SymbolSequence::symbolAt(int index)
+{
+	Node* leaf = leafAt(index);
+	return leaf->symbols[leaf->physicalIndex(index)];
+}
+
+const Symbol& SymbolSequence::first() const
+{
+	return (*this)[0];
+}
+
+const Symbol& SymbolSequence::last() const
+{
+	return (*this)[size() - 1];
+}
+
+
+int SymbolSequence::indexOf(const Position& pos) const
+{
+	if (_indexed)
+	{
+		// Find the chunk of the symbol in the hash index, then the symbol inside it
+		QHash<quint64, Node*>::const_iterator i = _locations.constFind(pos.fingerprint());
+		if (i != _locations.constEnd())
+		{
+			const Node* leaf = i.value();
+			const Symbol* slot = std::lower_bound(leaf->symbols.constBegin(), leaf->symbols.constEnd(), pos,
+				[](const Symbol& s, const Position& p) { return s.getPosition().compare(p) < 0; });
+			while (slot != leaf->symbols.constEnd() && slot->isDeleted() && slot->getPosition().compare(pos) == 0)
+				slot++;		// (tombstones with that position precede the symbol reinserted at it)
+
+			if (slot != leaf->symbols.constEnd() && !slot->isDeleted() && slot->getPosition().compare(pos) == 0)
+				return offsetOf(leaf) + leaf->liveIndex(int(slot - leaf->symbols.constBegin()));
+		}
+
+		// (missing or colliding fingerprint, fall back to the tree search)
+	}
+
+	int index = lowerBound(pos);
+
+	if (index < size() && (*this)[index].getPosition().compare(pos) == 0)
+		return index;
+	else return -1;
+}
+
+int SymbolSequence::lowerBound(const Position& pos) const
+{
+	int index = 0;
+	const Node* node = searchLeaf(root, pos, index);
+
+	// Binary search inside the leaf chunk, for the first slot with position >= pos (the first live symbol from
+	// there on has the index, even if tombstones with that position precede a symbol reinserted at it)
+	int lower = 0;
+	int higher = node->symbols.size() - 1;
+
+	while (lower <= higher)
+	{
+		int m = (lower + higher) / 2;
+
+		if (node->symbols[m].getPosition().compare(pos) < 0)
+			lower = m + 1;
+		else higher = m - 1;
+	}
+
+	return index + node->liveIndex(lower);
+}
+
+
+int SymbolSequence::indexOf(QChar c, int from) const
+{
+	if (from < 0)
+		from = 0;
+
+	// Scan the char column of each chunk, starting from the one which contains the index
+	while (from < size())
+	{
+		int offset = from;
+		const Node* leaf = leafAt(offset);
+		int n = leaf->count - offset;
+		int found = 0;
+
+		if (leaf->count == leaf->chars.size())
+			found = findChar(reinterpret_cast<const ushort*>(leaf->chars.constData()) + offset, n, c.unicode());
+		else
+		{
+			// Scalar scan of a chunk with tombstones
+			for (int slot = leaf->physicalIndex(offset); slot < leaf->symbols.size(); slot++)
+			{
+				if (leaf->symbols[slot].isDeleted())
+					continue;
+				if (leaf->chars[slot] == c)
+					break;
+				found++;
+			}
+		}
+
+		if (found < n)
+			return from + found;
+
+		from += n;
+	}
+
+	return -1;
+}
+
+int SymbolSequence::nextAuthorChange(int from, int to) const
+{
+	if (from < 0 || from >= to || to > size())
+		return to;
+
+	qint32 author = (*this)[from].getAuthorId();
+	int index = from + 1;
+
+	// Scan the author column of each chunk until a different value is found
+	while (index < to)
+	{
+		int offset = index;
+		const Node* leaf = leafAt(offset);
+		int n = std::min(leaf->count - offset, to - index);
+		int found = 0;
+
+		if (leaf->count == leaf->authors.size())
+			found = findOther(leaf->authors.constData() + offset, n, author);
+		else
+		{
+			// Scalar scan of a chunk with tombstones
+			for (int slot = leaf->physicalIndex(offset); slot < leaf->symbols.size() && found < n; slot++)
+			{
+				if (leaf->symbols[slot].isDeleted())
+					continue;
+				if (leaf->authors[slot] != author)
+					break;
+				found++;
+			}
+		}
+
+		if (found < n)
+			return index + found;
+
+		index += n;
+	}
+
+	return to;
+}
+
+QString SymbolSequence::text(int from, int count) const
+{
+	QString result;
+
+	from = std::clamp(from, 0, size());
+	count = std::clamp(count, 0, size() - from);
+	result.reserve(count);
+
+	// Copy whole slices of the char column of each chunk
+	while (count > 0)
+	{
+		int offset = from;
+		const Node* leaf = leafAt(offset);
+		int n = std::min(leaf->count - offset, count);
+
+		if (leaf->count == leaf->chars.size())
+			result.append(leaf->chars.constData() + offset, n);
+		else
+		{
+			// Skip the tombstones of the chunk
+			for (int slot = leaf->physicalIndex(offset), k = 0; k < n; slot++)
+			{
+				if (!leaf->symbols[slot].isDeleted()) {
+					result.append(leaf->chars[slot]);
+					k++;
+				}
+			}
+		}
+
+		from += n;
+		count -= n;
+	}
+
+	return result;
+}
+
+
+void SymbolSequence::insert(int index, const Symbol& s)
+{
+	Q_ASSERT(index >= 0 && index <= size());
+
+	Node* split = insertInto(root, index, s);
+	if (split)
+	{
+		// The root was split, the tree grows by one level
+		Node* newRoot = new Node(false);
+		newRoot->children = { root, split };
+		newRoot->count = root->count + split->count;
+		root->parent = split->parent = newRoot;
+		root = newRoot;
+	}
+}
+
+void SymbolSequence::insert(int index, const QVector<Symbol>& run)
+{
+	Q_ASSERT(index >= 0 && index <= size());
+
+	// The run is spliced in the leaf of its first symbol, unless tombstones of the following leaves
+	// are interleaved with it: the rest of the run is then spliced in the next leaf, and so on
+	for (int k = 0; k < run.size(); )
+	{
+		int offset = index + k;
+		QVector<Node*> split = insertRunInto(root, offset, run, k, nullptr);
+
+		while (!split.isEmpty())
+		{
+			// The root was split, the tree grows by one level (or more, if it was split in many nodes)
+			Node* newRoot = new Node(false);
+			newRoot->children = split;
+			newRoot->children.prepend(root);
+			for (Node* child : newRoot->children)
+			{
+				newRoot->count += child->count;
+				child->parent = newRoot;
+			}
+
+			root = newRoot;
+			split = splitChildren(root);
+		}
+	}
+}
+
+void SymbolSequence::removeAt(int index)
+{
+	Q_ASSERT(index >= 0 && index < size());
+
+	removeFrom(root, index);
+
+	if (!root->isLeaf && root->children.size() == 1)
+	{
+		// The root has a single child, the tree shrinks by one level
+		Node* newRoot = root->children.first();
+		root->children.clear();
+		delete root;
+		root = newRoot;
+		root->parent = nullptr;
+	}
+}
+
+void SymbolSequence::removeRange(int from, int count)
+{
+	Q_ASSERT(from >= 0 && count >= 0 && from + count <= size());
+
+	if (count == 0)
+		return;
+
+	removeFrom(root, from, count);
+
+	while (!root->isLeaf && root->children.size() < 2)
+	{
+		// The root has a single child (or none), the tree shrinks by one level
+		Node* newRoot = root->children.isEmpty() ? new Node(true) : root->children.first();
+		root->children.clear();
+		delete root;
+		root = newRoot;
+		root->parent = nullptr;
+	}
+}
+
+void SymbolSequence::clear()
+{
+	delete root;
+	root = new Node(true);
+	_arena.reset(new PositionArena);		// (the old one is released with the last copy sharing its chunks)
+	_mapped.reset();
+	_tombstones = 0;
+	_locations.clear();
+}
+
+
+void SymbolSequence::assign(const QVector<Symbol>& symbols)
+{
+	QVector<Node*> leaves;
+	int n = symbols.size();
+	int nLeaves = (n + SEQUENCE_LEAF_SIZE - 1) / SEQUENCE_LEAF_SIZE;
+
+	// Split the symbols in evenly filled chunks, and build the tree on top of them
+	for (int l = 0, from = 0; l < nLeaves; l++)
+	{
+		int length = n / nLeaves + (l < n % nLeaves ? 1 : 0);
+
+		Node* leaf = new Node(true);
+		leaf->symbols = symbols.mid(from, length);
+		leaf->count = liveCount(leaf->symbols);
+		leaf->refreshColumns();
+		leaves.append(leaf);
+
+		from += length;
+	}
+
+	build(leaves);
+	_arena.reset(new PositionArena);		// (the new chunks hold copies of the positions)
+	_tombstones = n - size();
+}
+
+
+// Applies the edits routed to a range of segments on a thread of the pool (or on the caller thread, if it takes it back first)
+class SegmentEditor : public QRunnable
+{
+public:
+
+	SymbolSequence* seq;
+	const QVector<SymbolEdit>* edits;
+	const QVector<int>* routes;					// indexes of the edits of each segment of the range
+	QVector<SymbolSequence::Node*>* parts;		// each segment of the range, followed by the siblings split from it
+	int count;									// number of segments in the range
+	QSemaphore* done;
+
+	SymbolSequence::IndexLog log;
+	int applied = 0;
+	int removed = 0;
+
+	void run() override
+	{
+		for (int c = 0; c < count; c++)
+		{
+			for (int e : routes[c])
+			{
+				const SymbolEdit& edit = edits->at(e);
+
+				if (seq->edit(parts[c], edit, &log))
+				{
+					applied++;
+					removed += edit.type == SymbolEdit::Removal ? 1 : 0;
+				}
+			}
+		}
+
+		done->release();
+	}
+};
+
+
+int SymbolSequence::apply(const QVector<SymbolEdit>& edits, int nThreads)
+{
+	if (edits.isEmpty())
+		return 0;
+
+	// The subtrees below the root are the segments, route each edit to the one of its position
+	QVector<Node*> segments = root->isLeaf ? QVector<Node*>({ root }) : root->children;
+	QVector<QVector<int>> routes(segments.size());
+	QVector<QVector<Node*>> parts(segments.size());
+
+	for (int c = 0; c < segments.size(); c++)
+		parts[c].append(segments[c]);
+
+	for (int e = 0; e < edits.size(); e++)
+		routes[root->isLeaf ? 0 : childAt(root, edits[e].symbol.getPosition())].append(e);
+
+	// Each thread edits a contiguous range of segments, with about the same number of edits
+	QThreadPool* pool = QThreadPool::globalInstance();
+	nThreads = qBound(1, nThreads, qMin(segments.size(), edits.size() / SEQUENCE_PARALLEL_EDITS));
+	QVector<SegmentEditor*> editors(nThreads);
+	QSemaphore done;
+
+	for (int t = 0, c = 0, assigned = 0; t < nThreads; t++)
+	{
+		int from = c;
+		int quota = int(qint64(edits.size()) * (t + 1) / nThreads);
+
+		while (c < segments.size() && (assigned < quota || t == nThreads - 1))
+			assigned += routes[c++].size();
+
+		editors[t] = new SegmentEditor;
+		editors[t]->setAutoDelete(false);
+		editors[t]->seq = this;
+		editors[t]->edits = &edits;
+		editors[t]->routes = routes.constData() + from;
+		editors[t]->parts = parts.data() + from;
+		editors[t]->count = c - from;
+		editors[t]->done = &done;
+	}
+
+	// The calling thread edits the first range, and any other which has not been started by the pool yet
+	for (int t = 1; t < nThreads; t++)
+		pool->start(editors[t]);
+
+	editors[0]->run();
+	for (int t = 1; t < nThreads; t++)
+	{
+		if (pool->tryTake(editors[t]))
+			editors[t]->run();
+	}
+
+	done.acquire(nThreads);
+
+	// Put the segments (and the siblings split from them) back below the root
+	QVector<Node*> level;
+	for (const QVector<Node*>& part : parts)
+		level.append(part);
+
+	if (!root->isLeaf && level.size() <= SEQUENCE_NODE_SIZE)
+	{
+		root->children = level;
+		root->count = 0;
+
+		for (Node* child : level)
+		{
+			root->count += child->count;
+			child->parent = root;
+		}
+	}
+	else if (level.size() > 1)
+	{
+		// The root was split, the tree grows by one level
+		root->children.clear();
+		if (!root->isLeaf)
+			delete root;
+
+		root = stack(level);
+		root->parent = nullptr;
+	}
+
+	int applied = 0;
+	for (SegmentEditor* editor : editors)
+	{
+		for (const QPair<quint64, Node*>& change : editor->log)
+			relocate(change.first, change.second);
+
+		applied += editor->applied;
+		_tombstones += editor->removed;
+	}
+
+	qDeleteAll(editors);
+
+	return applied;
+}
+
+
+QVector<SymbolChunk> SymbolSequence::chunks() const
+{
+	QVector<SymbolChunk> result;
+	collectChunks(root, result);
+
+	return result;
+}
+
+void SymbolSequence::setIndexed(bool enabled)
+{
+	_indexed = enabled;
+	_locations.clear();
+
+	if (_indexed)
+	{
+		_locations.reserve(size());
+		reindex(root);
+	}
+}
+
+bool SymbolSequence::isIndexed() const
+{
+	return _indexed;
+}
+
+
+void SymbolSequence::tombstone(int index)
+{
+	Q_ASSERT(index >= 0 && index < size());
+
+	markFrom(root, index);
+	_tombstones++;
+}
+
+void SymbolSequence::tombstone(int from, int count)
+{
+	Q_ASSERT(from >= 0 && count >= 0 && from + count <= size());
+
+	if (count == 0)
+		return;
+
+	markFrom(root, from, count);
+	_tombstones += count;
+}
+
+int SymbolSequence::tombstones() const
+{
+	return _tombstones;
+}
+
+void SymbolSequence::purge()
+{
+	if (_tombstones == 0)
+		return;
+
+	// Move the live symbols into new evenly filled chunks, and build the tree on top of them
+	QVector<Node*> leaves;
+	Node* leaf = nullptr;
+	int n = size();
+	int nLeaves = (n + SEQUENCE_LEAF_SIZE - 1) / SEQUENCE_LEAF_SIZE;
+	auto leafSize = [n, nLeaves](int l) { return n / nLeaves + (l < n % nLeaves ? 1 : 0); };
+
+	for (iterator s = begin(); s != end(); s++)
+	{
+		if (!leaf || leaf->symbols.size() == leafSize(leaves.size() - 1))
+		{
+			leaf = new Node(true);
+			leaf->symbols.reserve(leafSize(leaves.size()));
+			leaves.append(leaf);
+		}
+
+		leaf->symbols.append(std::move(*s));		// (positions in the arena stay there)
+	}
+
+	for (Node* chunk : leaves)
+	{
+		chunk->count = chunk->symbols.size();
+		chunk->refreshColumns();
+	}
+
+	build(leaves);
+	_tombstones = 0;
+}
+
+
+SymbolSequence::iterator SymbolSequence::begin()
+{
+	return iterator(this, 0);
+}
+
+SymbolSequence::iterator SymbolSequence::end()
+{
+	return iterator(this, size());
+}
+
+SymbolSequence::const_iterator SymbolSequence::begin() const
+{
+	return const_iterator(this, 0);
+}
+
+SymbolSequence::const_iterator SymbolSequence::end() const
+{
+	return const_iterator(this, size());
+}
+
+QVector<Symbol> SymbolSequence::toVector(bool withTombstones) const
+{
+	QVector<Symbol> result;
+
+	if (withTombstones)
+	{
+		result.reserve(size() + _tombstones);
+		collectSymbols(root, result);
+		return result;
+	}
+
+	result.reserve(size());
+	for (const_iterator s = begin(); s != end(); s++)
+		result.append(*s);
+
+	return result;
+}
+
+QPair<qint64, int> SymbolSequence::positionLevels() const
+{
+	qint64 total = 0;
+	int max = 0;
+
+	countLevels(root, total, max);
+	return QPair<qint64, int>(total, max);
+}
+
+
+/*************** TREE ALGORITHMS ***************/
+
+
+SymbolSequence::Node* SymbolSequence::leafAt(int& index) const
+{
+	Node* node = root;
+
+	while (!node->isLeaf)
+	{
+		int i = 0;
+		while (index >= node->children[i]->count)
+			index -= node->children[i++]->count;
+
+		node = node->children[i];
+	}
+
+	expand(node);
+	return node;
+}
+
+void SymbolSequence::expand(Node* leaf)
+{
+	if (leaf->page.isNull())
+		return;
+
+	QByteArray page = leaf->compressed ? qUncompress(leaf->page) : leaf->page;
+	QDataStream in(page);
+	QVector<Node*> decoded;
+
+	// (the number of symbols was checked when the page was mapped, its contents are checked while they are decoded)
+	bool valid = decodeSegment(in, quint32(leaf->count), decoded, nullptr) && decoded.size() == 1;
+	Q_ASSERT(valid);
+
+	if (valid)
+	{
+		leaf->symbols.swap(decoded.first()->symbols);
+		leaf->chars.swap(decoded.first()->chars);
+		leaf->authors.swap(decoded.first()->authors);
+	}
+
+	qDeleteAll(decoded);
+	leaf->page = QByteArray();
+	leaf->compressed = false;
+	leaf->head = Position();
+}
+
+void SymbolSequence::collectChunks(const Node* node, QVector<SymbolChunk>& chunks)
+{
+	if (!node->isLeaf)
+	{
+		for (const Node* child : node->children)
+			collectChunks(child, chunks);
+	}
+	else if (node->count > 0)		// (chunks which only hold tombstones are skipped)
+	{
+		// The symbols are shared with the chunk, without detaching it
+		SymbolChunk chunk;
+		chunk.symbols = node->symbols;
+		chunk.page = node->page;
+		chunk.compressed = node->compressed;
+		chunk.summary.count = quint32(node->count);
+		if (!node->page.isNull())
+		{
+			chunk.summary.head = node->head;
+			chunk.summary.levels = node->levels;
+			chunk.summary.depth = node->depth;
+		}
+
+		chunks.append(chunk);
+	}
+}
+
+void SymbolSequence::collectSymbols(Node* node, QVector<Symbol>& symbols)
+{
+	if (!node->isLeaf)
+	{
+		for (Node* child : node->children)
+			collectSymbols(child, symbols);
+	}
+	else
+	{
+		expand(node);
+		symbols.append(node->symbols);
+	}
+}
+
+void SymbolSequence::countLevels(const Node* node, qint64& total, int& max)
+{
+	if (!node->isLeaf)
+	{
+		for (const Node* child : node->children)
+			countLevels(child, total, max);
+	}
+	else if (!node->page.isNull())
+	{
+		// (counted when the page was scanned)
+		total += node->levels;
+		max = std::max(max, node->depth);
+	}
+	else for (const Symbol& s : node->symbols)
+	{
+		if (!s.isDeleted())
+		{
+			total += s.getPosition().size();
+			max = std::max(max, s.getPosition().size());
+		}
+	}
+}
+
+int SymbolSequence::offsetOf(const Node* node) const
+{
+	int index = 0;
+
+	// Add up the symbols in the preceding siblings of each ancestor
+	for (const Node* p = node->parent; p != nullptr; node = p, p = p->parent)
+	{
+		for (const Node* sibling : p->children)
+		{
+			if (sibling == node)
+				break;
+			index += sibling->count;
+		}
+	}
+
+	return index;
+}
+
+// Inserts the symbol in the subtree, returns the new sibling node if the subtree root had to be split
+SymbolSequence::Node* SymbolSequence::insertInto(Node* node, int index, const Symbol& s, IndexLog* log)
+{
+	node->count++;
+
+	if (node->isLeaf)
+	{
+		expand(node);
+
+		if (node->count - 1 != node->symbols.size())
+		{
+			// Among the tombstones around the index, the symbol goes in the slot of its position
+			// (after the tombstones with the same position, if it's reinserted)
+			index = std::upper_bound(node->symbols.begin(), node->symbols.end(), s,
+				[](const Symbol& a, const Symbol& b) { return a.getPosition().compare(b.getPosition()) < 0; }) - node->symbols.begin();
+		}
+
+		node->insertSymbol(index, s);
+		relocate(s.getPosition().fingerprint(), node, log);
+
+		if (node->symbols.size() > SEQUENCE_LEAF_SIZE)
+		{
+			// Split the full chunk in two halves
+			int half = node->symbols.size() / 2;
+			Node* sibling = new Node(true);
+			sibling->symbols = node->symbols.mid(half);
+			sibling->count = liveCount(sibling->symbols);
+			sibling->refreshColumns();
+			node->symbols.remove(half, sibling->symbols.size());
+			node->chars.resize(half);
+			node->authors.resize(half);
+			node->count -= sibling->count;
+			locate(sibling, 0, log);
+
+			return sibling;
+		}
+
+		return nullptr;
+	}
+
+	// Find the child which contains the index
+	int i = 0;
+	while (i < node->children.size() - 1 && index > node->children[i]->count)
+		index -= node->children[i++]->count;
+
+	// At the boundary between children, tombstones may precede (or have) the position in the following one
+	while (i < node->children.size() - 1 && index == node->children[i]->count &&
+		firstPosition(node->children[i + 1]).compare(s.getPosition()) <= 0)
+		index -= node->children[i++]->count;
+
+	Node* split = insertInto(node->children[i], index, s, log);
+	if (split)
+	{
+		node->children.insert(i + 1, split);
+		split->parent = node;
+
+		if (node->children.size() > SEQUENCE_NODE_SIZE)
+		{
+			// Split the inner node in two halves
+			int half = node->children.size() / 2;
+			Node* sibling = new Node(false);
+			sibling->children = node->children.mid(half);
+			node->children.remove(half, sibling->children.size());
+
+			for (Node* child : sibling->children)
+			{
+				sibling->count += child->count;
+				child->parent = sibling;
+			}
+			node->count -= sibling->count;
+
+			return sibling;
+		}
+	}
+
+	return nullptr;
+}
+
+// Splices the symbols of the run from 'next' on in the subtree at once, up to the first one which doesn't precede
+// the limit (the first position after the subtree). Advances 'next' past them, and returns the new sibling nodes
+// if the subtree root had to be split
+QVector<SymbolSequence::Node*> SymbolSequence::insertRunInto(Node* node, int index, const QVector<Symbol>& run,
+	int& next, const Position* limit)
+{
+	if (node->isLeaf)
+	{
+		auto precedes = [](const Symbol& a, const Symbol& b) { return a.getPosition().compare(b.getPosition()) < 0; };
+		int from = next++;
+
+		expand(node);
+
+		while (next < run.size() && (!limit || run[next].getPosition().compare(*limit) < 0))
+			next++;
+
+		QVector<Symbol> spliced;
+		int slot = index;
+
+		if (node->count == node->symbols.size())
+		{
+			spliced.reserve(node->symbols.size() + next - from);
+			spliced.append(node->symbols.mid(0, index));
+			spliced.append(run.mid(from, next - from));
+			spliced.append(node->symbols.mid(index));
+		}
+		else
+		{
+			// (tombstones can be interleaved with the run)
+			slot = std::lower_bound(node->symbols.begin(), node->symbols.end(), run[from], precedes) - node->symbols.begin();
+			spliced.resize(node->symbols.size() + next - from);
+			std::merge(node->symbols.constBegin(), node->symbols.constEnd(), run.constBegin() + from, run.constBegin() + next,
+				spliced.begin(), precedes);
+		}
+
+		// Split the chunk in evenly filled ones if it overflows
+		QVector<Node*> siblings;
+		int n = spliced.size();
+		int nLeaves = (n + SEQUENCE_LEAF_SIZE - 1) / SEQUENCE_LEAF_SIZE;
+
+		for (int l = 0, first = 0; l < nLeaves; l++)
+		{
+			int length = n / nLeaves + (l < n % nLeaves ? 1 : 0);
+			Node* chunk = l == 0 ? node : new Node(true);
+
+			chunk->symbols = nLeaves == 1 ? spliced : spliced.mid(first, length);
+			chunk->count = liveCount(chunk->symbols);
+			chunk->refreshColumns();
+			if (l > 0)
+			{
+				siblings.append(chunk);
+				locate(chunk);
+			}
+
+			first += length;
+		}
+
+		locate(node, std::min(slot, node->symbols.size()));
+		return siblings;
+	}
+
+	// Find the child which contains the index (as insertInto does)
+	const Position& pos = run[next].getPosition();
+	int from = next;
+	int i = 0;
+
+	while (i < node->children.size() - 1 && index > node->children[i]->count)
+		index -= node->children[i++]->count;
+
+	while (i < node->children.size() - 1 && index == node->children[i]->count &&
+		firstPosition(node->children[i + 1]).compare(pos) <= 0)
+		index -= node->children[i++]->count;
+
+	const Position* childLimit = i < node->children.size() - 1 ? &firstPosition(node->children[i + 1]) : limit;
+	QVector<Node*> split = insertRunInto(node->children[i], index, run, next, childLimit);
+
+	node->count += next - from;
+	for (int k = 0; k < split.size(); k++)
+	{
+		node->children.insert(i + 1 + k, split[k]);
+		split[k]->parent = node;
+	}
+
+	return splitChildren(node);
+}
+
+// Splits an inner node which overflows in evenly filled ones, returns the new ones which follow it
+QVector<SymbolSequence::Node*> SymbolSequence::splitChildren(Node* node)
+{
+	QVector<Node*> siblings;
+	if (node->children.size() <= SEQUENCE_NODE_SIZE)
+		return siblings;
+
+	QVector<Node*> children = node->children;
+	int n = children.size();
+	int nParts = (n + SEQUENCE_NODE_SIZE - 1) / SEQUENCE_NODE_SIZE;
+
+	for (int p = 0, from = 0; p < nParts; p++)
+	{
+		int length = n / nParts + (p < n % nParts ? 1 : 0);
+		Node* part = p == 0 ? node : new Node(false);
+
+		part->children = children.mid(from, length);
+		part->count = 0;
+		for (Node* child : part->children)
+		{
+			part->count += child->count;
+			child->parent = part;
+		}
+
+		if (p > 0)
+			siblings.append(part);
+
+		from += length;
+	}
+
+	return siblings;
+}
+
+void SymbolSequence::removeFrom(Node* node, int index)
+{
+	if (node->isLeaf)
+	{
+		expand(node);
+
+		int slot = node->physicalIndex(index);
+		relocate(node->symbols[slot].getPosition().fingerprint(), nullptr);
+
+		node->removeSymbol(slot);
+		node->count--;
+		return;
+	}
+
+	node->count--;
+
+	// Find the child which contains the index
+	int i = 0;
+	while (index >= node->children[i]->count)
+		index -= node->children[i++]->count;
+
+	Node* child = node->children[i];
+	removeFrom(child, index);
+
+	// Merge or refill the child if it became too small
+	if ((child->isLeaf && child->symbols.size() < SEQUENCE_LEAF_SIZE / 4) ||
+		(!child->isLeaf && child->children.size() < SEQUENCE_NODE_SIZE / 4))
+	{
+		rebalance(node, i);
+	}
+}
+
+void SymbolSequence::removeFrom(Node* node, int from, int count)
+{
+	node->count -= count;
+
+	if (node->isLeaf)
+	{
+		expand(node);
+
+		// Compact the slots which follow the range over it (the tombstones inside it are kept)
+		int w = node->physicalIndex(from);
+		int removed = 0;
+
+		for (int r = w; r < node->symbols.size(); r++)
+		{
+			if (removed < count && !node->symbols[r].isDeleted())
+			{
+				relocate(node->symbols[r].getPosition().fingerprint(), nullptr);
+				removed++;
+				continue;
+			}
+
+			if (w != r)
+			{
+				node->symbols[w] = node->symbols[r];
+				node->chars[w] = node->chars[r];
+				node->authors[w] = node->authors[r];
+			}
+			w++;
+		}
+
+		node->symbols.resize(w);
+		node->chars.resize(w);
+		node->authors.resize(w);
+		return;
+	}
+
+	QVector<Node*> edges;		// children which are only partly inside the range
+
+	for (int i = 0; i < node->children.size() && count > 0; )
+	{
+		Node* child = node->children[i];
+		if (from >= child->count)
+		{
+			from -= child->count;
+			i++;
+			continue;
+		}
+
+		int n = std::min(count, child->count - from);
+		if (from == 0 && n == child->count)
+		{
+			node->children.removeAt(i);
+			forget(child);
+			delete child;
+		}
+		else
+		{
+			removeFrom(child, from, n);
+			edges.append(child);
+			i++;
+		}
+
+		from = 0;
+		count -= n;
+	}
+
+	// Merge or refill the edges of the range if they became too small
+	for (Node* child : edges)
+	{
+		int i = node->children.indexOf(child);
+
+		if (i >= 0 && ((child->isLeaf && child->symbols.size() < SEQUENCE_LEAF_SIZE / 4) ||
+			(!child->isLeaf && child->children.size() < SEQUENCE_NODE_SIZE / 4)))
+		{
+			rebalance(node, i);
+		}
+	}
+}
+
+void SymbolSequence::forget(const Node* node)
+{
+	if (!node->isLeaf)
+	{
+		for (const Node* child : node->children)
+			forget(child);
+	}
+	else if (node->page.isNull())		// (the encoded leaves have no tombstones, and are not indexed)
+	{
+		_tombstones -= node->symbols.size() - node->count;
+
+		for (const Symbol& s : node->symbols)
+		{
+			if (!s.isDeleted())
+				relocate(s.getPosition().fingerprint(), nullptr);
+		}
+	}
+}
+
+void SymbolSequence::markFrom(Node* node, int index, IndexLog* log)
+{
+	// Descend to the leaf updating the counts, the symbol stays in its slot
+	while (!node->isLeaf)
+	{
+		node->count--;
+
+		int i = 0;
+		while (index >= node->children[i]->count)
+			index -= node->children[i++]->count;
+
+		node = node->children[i];
+	}
+
+	expand(node);
+
+	int slot = node->physicalIndex(index);
+	node->symbols[slot]._deleted = true;
+	node->count--;
+
+	relocate(node->symbols[slot].getPosition().fingerprint(), nullptr, log);
+}
+
+void SymbolSequence::markFrom(Node* node, int from, int count)
+{
+	if (node->isLeaf)
+	{
+		expand(node);
+
+		// (the marked symbols stay in their slots)
+		for (int slot = node->physicalIndex(from), marked = 0; marked < count; slot++)
+		{
+			if (!node->symbols[slot].isDeleted())
+			{
+				node->symbols[slot]._deleted = true;
+				marked++;
+
+				relocate(node->symbols[slot].getPosition().fingerprint(), nullptr);
+			}
+		}
+
+		node->count -= count;
+		return;
+	}
+
+	node->count -= count;
+
+	for (int i = 0; count > 0; i++)
+	{
+		Node* child = node->children[i];
+		if (from >= child->count)
+		{
+			from -= child->count;
+			continue;
+		}
+
+		int n = std::min(count, child->count - from);
+		markFrom(child, from, n);
+
+		from = 0;
+		count -= n;
+	}
+}
+
+// Merges the specified child of node with one of its siblings, or evenly redistributes their contents
+void SymbolSequence::rebalance(Node* node, int child)
+{
+	if (node->children.size() < 2)
+		return;
+
+	int l = child + 1 < node->children.size() ? child : child - 1;
+	Node* left = node->children[l];
+	Node* right = node->children[l + 1];
+
+	if (left->isLeaf)
+	{
+		expand(left);
+		expand(right);
+
+		int total = left->symbols.size() + right->symbols.size();
+		int moved = left->symbols.size();
+		left->symbols.append(right->symbols);
+		left->chars.append(right->chars);
+		left->authors.append(right->authors);
+
+		if (total <= SEQUENCE_LEAF_SIZE)
+		{
+			left->count += right->count;
+			node->children.removeAt(l + 1);
+			delete right;
+			locate(left, moved);
+		}
+		else
+		{
+			int half = total / 2;
+			int live = left->count + right->count;
+			right->symbols = left->symbols.mid(half);
+			right->refreshColumns();
+			right->count = liveCount(right->symbols);
+			left->symbols.remove(half, total - half);
+			left->chars.resize(half);
+			left->authors.resize(half);
+			left->count = live - right->count;
+			locate(left, moved);
+			locate(right);
+		}
+	}
+	else
+	{
+		int total = left->children.size() + right->children.size();
+		left->children.append(right->children);
+		right->children.clear();
+
+		for (Node* n : left->children)
+			n->parent = left;
+
+		if (total <= SEQUENCE_NODE_SIZE)
+		{
+			left->count += right->count;
+			node->children.removeAt(l + 1);
+			delete right;
+		}
+		else
+		{
+			int half = total / 2;
+			right->children = left->children.mid(half);
+			left->children.remove(half, total - half);
+
+			int moved = 0;
+			for (Node* n : right->children)
+			{
+				moved += n->count;
+				n->parent = right;
+			}
+
+			left->count = left->count + right->count - moved;
+			right->count = moved;
+		}
+	}
+}
+
+const Position& SymbolSequence::firstPosition(const Node* node)
+{
+	while (!node->isLeaf)
+		node = node->children.first();
+
+	if (!node->page.isNull())
+		return node->head;		// (without decoding the leaf)
+
+	Q_ASSERT(!node->symbols.isEmpty());
+	return node->symbols.first().getPosition();
+}
+
+int SymbolSequence::childAt(const Node* node, const Position& pos)
+{
+	int lower = 1;
+	int higher = node->children.size() - 1;
+	int c = 0;
+
+	// Binary search on the first positions of the children
+	while (lower <= higher)
+	{
+		int m = (lower + higher) / 2;
+
+		if (firstPosition(node->children[m]).compare(pos) > 0)
+			higher = m - 1;
+		else
+		{
+			c = m;
+			lower = m + 1;
+		}
+	}
+
+	return c;
+}
+
+SymbolSequence::Node* SymbolSequence::searchLeaf(Node* node, const Position& pos, int& index)
+{
+	while (!node->isLeaf)
+	{
+		int c = childAt(node, pos);
+
+		// Skip all the symbols in the preceding subtrees
+		for (int i = 0; i < c; i++)
+			index += node->children[i]->count;
+
+		node = node->children[c];
+	}
+
+	expand(node);
+	return node;
+}
+
+bool SymbolSequence::edit(QVector<Node*>& subtrees, const SymbolEdit& e, IndexLog* log)
+{
+	const Position& pos = e.symbol.getPosition();
+
+	// The split siblings follow the subtree they come from, in position order
+	int t = subtrees.size() - 1;
+	while (t > 0 && firstPosition(subtrees[t]).compare(pos) > 0)
+		t--;
+
+	int index = 0;
+	Node* subtree = subtrees[t];
+	Node* leaf = searchLeaf(subtree, pos, index);
+	int slot = int(std::lower_bound(leaf->symbols.constBegin(), leaf->symbols.constEnd(), pos,
+		[](const Symbol& s, const Position& p) { return s.getPosition().compare(p) < 0; }) - leaf->symbols.constBegin());
+	while (slot < leaf->symbols.size() && leaf->symbols.at(slot).isDeleted() && leaf->symbols.at(slot).getPosition().compare(pos) == 0)
+		slot++;		// (a symbol reinserted at the position of tombstones follows them)
+
+	bool found = slot < leaf->symbols.size() && !leaf->symbols.at(slot).isDeleted() &&
+		leaf->symbols.at(slot).getPosition().compare(pos) == 0;
+	index += leaf->liveIndex(slot);
+
+	switch (e.type)
+	{
+	case SymbolEdit::Insertion:
+		if (found)
+			return false;		// (the symbol is already in the sequence)
+		if (Node* split = insertInto(subtree, index, e.symbol, log))
+			subtrees.insert(t + 1, split);
+		return true;
+
+	case SymbolEdit::Removal:
+		if (!found)
+			return false;		// (the symbol was already deleted)
+		markFrom(subtree, index, log);
+		return true;
+
+	case SymbolEdit::Formatting:
+		if (!found)
+			return false;
+		leaf->symbols[slot].setFormatIndex(e.symbol.getFormatIndex());
+		return true;
+	}
+
+	return false;
+}
+
+
+void SymbolSequence::build(QVector<Node*> level)
+{
+	delete root;
+	_locations.clear();
+
+	if (level.isEmpty())
+	{
+		root = new Node(true);
+		return;
+	}
+
+	root = stack(level);
+	root->parent = nullptr;
+
+	if (_indexed)
+		reindex(root);
+}
+
+SymbolSequence::Node* SymbolSequence::stack(QVector<Node*> level)
+{
+	// Group the nodes of each level under new inner nodes, until a single root is left
+	while (level.size() > 1)
+	{
+		QVector<Node*> parents;
+		int nParents = (level.size() + SEQUENCE_NODE_SIZE - 1) / SEQUENCE_NODE_SIZE;
+
+		for (int p = 0, i = 0; p < nParents; p++)
+		{
+			// Children are evenly distributed among the parents
+			int nChildren = level.size() / nParents + (p < level.size() % nParents ? 1 : 0);
+			Node* parent = new Node(false);
+
+			for (int j = 0; j < nChildren; j++, i++)
+			{
+				parent->children.append(level[i]);
+				parent->count += level[i]->count;
+				level[i]->parent = parent;
+			}
+
+			parents.append(parent);
+		}
+
+		level = parents;
+	}
+
+	return level.first();
+}
+
+
+void SymbolSequence::locate(Node* leaf, int from, IndexLog* log)
+{
+	if (!_indexed || !leaf->page.isNull())
+		return;		// (the symbols of the encoded leaves are found by the tree search, until they are decoded and moved)
+
+	for (int i = from; i < leaf->symbols.size(); i++)
+	{
+		if (!leaf->symbols[i].isDeleted())
+			relocate(leaf->symbols[i].getPosition().fingerprint(), leaf, log);
+	}
+}
+
+// Maps the fingerprint to the leaf (or removes it, if the leaf is null), or logs the change if a log is given
+void SymbolSequence::relocate(quint64 fingerprint, Node* leaf, IndexLog* log)
+{
+	if (!_indexed)
+		return;
+
+	if (log)
+		log->append(qMakePair(fingerprint, leaf));
+	else if (leaf)
+		_locations.insert(fingerprint, leaf);
+	else _locations.remove(fingerprint);
+}
+
+void SymbolSequence::reindex(Node* node)
+{
+	if (node->isLeaf)
+		locate(node);
+	else for (Node* child : node->children)
+		reindex(child);
+}
+
+
+/*************** ITERATOR ***************/
+
+
+template<class T>
+SymbolSequence::Iterator<T>::Iterator()
+	: _seq(nullptr), _leaf(nullptr), _index(0), _offset(0)
+{
+}
+
+template<class T>
+SymbolSequence::Iterator<T>::Iterator(const SymbolSequence* seq, int index)
+	: _seq(seq), _leaf(nullptr), _index(index), _offset(index)
+{
+	if (index >= 0 && index < seq->size())
+	{
+		_leaf = seq->leafAt(_offset);
+		_offset = _leaf->physicalIndex(_offset);
+	}
+}
+
+template<class T>
+T& SymbolSequence::Iterator<T>::operator*() const
+{
+	return _leaf->symbols[_offset];		// (only the mutable iterator detaches a shared chunk)
+}
+
+template<class T>
+T* SymbolSequence::Iterator<T>::operator->() const
+{
+	return &_leaf->symbols[_offset];
+}
+
+template<class T>
+SymbolSequence::Iterator<T>& SymbolSequence::Iterator<T>::operator++()
+{
+	_index++;
+	_offset++;
+
+	while (_offset < _leaf->symbols.size() && _leaf->symbols.at(_offset).isDeleted())
+		_offset++;		// (skip the tombstones)
+
+	if (_offset >= _leaf->symbols.size())
+	{
+		// Move to the following chunk
+		*this = Iterator(_seq, _index);
+	}
+
+	return *this;
+}
+
+template<class T>
+SymbolSequence::Iterator<T> SymbolSequence::Iterator<T>::operator++(int)
+{
+	Iterator i = *this;
+	++(*this);
+	return i;
+}
+
+template<class T>
+SymbolSequence::Iterator<T> SymbolSequence::Iterator<T>::operator+(int n) const
+{
+	return Iterator(_seq, _index + n);
+}
+
+template<class T>
+SymbolSequence::Iterator<T> SymbolSequence::Iterator<T>::operator-(int n) const
+{
+	return Iterator(_seq, _index - n);
+}
+
+template<class T>
+int SymbolSequence::Iterator<T>::index() const
+{
+	return _index;
+}
+
+template<class T>
+bool SymbolSequence::Iterator<T>::operator==(const Iterator& other) const
+{
+	return _index == other._index;
+}
+
+template<class T>
+bool SymbolSequence::Iterator<T>::operator!=(const Iterator& other) const
+{
+	return _index != other._index;
+}
+
+template<class T>
+bool SymbolSequence::Iterator<T>::operator<(const Iterator& other) const
+{
+	return _index < other._index;
+}
+
+template class SymbolSequence::Iterator<Symbol>;
+template class SymbolSequence::Iterator<const Symbol>;
+
+
+/*************** SERIALIZATION OPERATORS ***************/
+
+
+/* A span is a run of consecutive symbols with the same format, whose positions only
+   differ in the level before the author id by a constant step (as generated when typing) */
+
+// Checks if the symbol can be the next one (n-th) of the span which begins with the first symbol
+static bool extendsSpan(const Symbol& first, const Symbol& next, int n, qint32& step)
+{
+	const Position& a = first.getPosition();
+	const Position& b = next.getPosition();
+	int level = a.size() - 2;
+
+	if (level < 0 || a.size() != b.size() || first.getFormatIndex() != next.getFormatIndex())
+		return false;
+
+	for (int i = 0; i < a.size(); i++)
+	{
+		if (i != level && a[i] != b[i])
+			return false;
+	}
+
+	if (n == 1)
+		step = b[level] - a[level];		// the second symbol sets the step of the span
+
+	return step > 0 && qint64(b[level]) == qint64(a[level]) + qint64(n) * step;
+}
+
+/* Fields of a span, as stored in a stream */
+struct Span
+{
+	Position first;
+	quint32 length;
+	qint32 step;
+	QString chars;
+	qint32 fmtIndex;
+};
+
+// Reads the next span of a segment which still holds the remaining symbols, returns false if it's corrupt
+static bool readSpan(QDataStream& in, quint32 remaining, Span& span)
+{
+	in >> span.first >> span.length >> span.step >> span.chars >> span.fmtIndex;
+
+	return in.status() == QDataStream::Ok && span.length > 0 && span.length <= remaining &&
+		span.chars.size() == int(span.length) && (span.length == 1 || span.first.size() >= 2);
+}
+
+// Checks the spans of a page without expanding them, and reads the position of its first symbol and
+// the number of levels of its positions (all the symbols of a span have as many as the first one)
+static bool scanPage(const QByteArray& page, quint32 n, Position& head, int& levels, int& depth)
+{
+	QDataStream in(page);
+	Span span;
+
+	levels = depth = 0;
+	for (quint32 remaining = n; remaining > 0; remaining -= span.length)
+	{
+		if (!readSpan(in, remaining, span))
+			return false;
+		if (remaining == n)
+			head = span.first;
+
+		levels += span.first.size() * int(span.length);
+		depth = std::max(depth, int(span.first.size()));
+	}
+
+	return n > 0;
+}
+
+
+// Decodes a range of segments on a thread of the pool (or on the caller thread, if it takes it back first)
+class SegmentDecoder : public QRunnable
+{
+public:
+
+	const QByteArray* segments;		// bytes of the segments in the range
+	const quint32* counts;			// number of symbols in each segment of the range
+	int count;						// number of segments in the range
+	int version;
+	QDataStream::ByteOrder byteOrder;
+	QSemaphore* done;
+
+	QVector<SymbolSequence::Node*> leaves;
+	PositionArena arena;
+	bool failed = false;
+
+	void run() override
+	{
+		for (int k = 0; k < count && !failed; k++)
+		{
+			QDataStream in(segments[k]);
+			in.setVersion(version);
+			in.setByteOrder(byteOrder);
+
+			failed = !SymbolSequence::decodeSegment(in, counts[k], leaves, &arena);
+		}
+
+		done->release();
+	}
+};
+
+
+bool SymbolSequence::decodeSegment(QDataStream& in, quint32 n, QVector<Node*>& leaves, PositionArena* arena)
+{
+	Node* leaf = nullptr;
+	int first = leaves.size();
+
+	// Symbols are expanded from their spans directly into evenly filled chunks
+	int nLeaves = (n + SEQUENCE_LEAF_SIZE - 1) / SEQUENCE_LEAF_SIZE;
+	auto leafSize = [n, nLeaves](int l) { return int(n / nLeaves + (l < int(n % nLeaves) ? 1 : 0)); };
+	quint32 remaining = n;
+
+	while (remaining > 0)
+	{
+		Span span;
+		if (!readSpan(in, remaining, span))
+			return false;
+
+		const Position& fPos = span.first;
+
+		for (int i = 0; i < int(span.length); i++)
+		{
+			if (!leaf || leaf->symbols.size() == leafSize(leaves.size() - first - 1))
+			{
+				// Begin the next chunk
+				leaf = new Node(true);
+				leaf->symbols.reserve(leafSize(leaves.size() - first));
+				leaves.append(leaf);
+			}
+
+			// The deep levels of the expanded positions are carved from the arena
+			leaf->symbols.append(Symbol(span.chars[i], span.fmtIndex,
+				i ? fPos.shifted(fPos.size() - 2, i * span.step, arena) : arena ? Position(fPos, *arena) : fPos));
+		}
+
+		remaining -= span.length;
+	}
+
+	for (int l = first; l < leaves.size(); l++)
+	{
+		leaves[l]->count = leaves[l]->symbols.size();
+		leaves[l]->refreshColumns();
+	}
+
+	return true;
+}
+
+
+bool SymbolSequence::decodeSegments(const QVector<QByteArray>& segments, const QVector<quint32>& counts,
+	int version, QDataStream::ByteOrder byteOrder)
+{
+	quint32 n = 0;
+	for (quint32 count : counts)
+		n += count;
+
+	// Each thread decodes a contiguous range of segments, into its own chunks and arena (on a single core,
+	// or if the sequence is too short to pay for the threads, the calling thread decodes all of them)
+	QThreadPool* pool = QThreadPool::globalInstance();
+	int nThreads = qBound(1, qMin(pool->maxThreadCount(), QThread::idealThreadCount()),
+		qMin(segments.size(), int(n / SEQUENCE_PARALLEL_SYMBOLS)));
+	QVector<SegmentDecoder*> decoders(nThreads);
+	QSemaphore done;
+
+	for (int t = 0, k = 0; t < nThreads; t++)
+	{
+		int to = int(qint64(segments.size()) * (t + 1) / nThreads);
+
+		decoders[t] = new SegmentDecoder;
+		decoders[t]->setAutoDelete(false);
+		decoders[t]->segments = segments.constData() + k;
+		decoders[t]->counts = counts.constData() + k;
+		decoders[t]->count = to - k;
+		decoders[t]->version = version;
+		decoders[t]->byteOrder = byteOrder;
+		decoders[t]->done = &done;
+		k = to;
+	}
+
+	// The calling thread decodes the first range, and any other which has not been started by the pool yet
+	for (int t = 1; t < nThreads; t++)
+		pool->start(decoders[t]);
+
+	decoders[0]->run();
+	for (int t = 1; t < nThreads; t++)
+	{
+		if (pool->tryTake(decoders[t]))
+			decoders[t]->run();
+	}
+
+	done.acquire(nThreads);
+
+	// Stitch the chunks of all the segments together, and build the tree on top of them
+	QVector<Node*> chunks;
+	bool failed = false;
+
+	chunks.reserve(int((n + SEQUENCE_LEAF_SIZE - 1) / SEQUENCE_LEAF_SIZE) + segments.size());
+	for (SegmentDecoder* decoder : decoders)
+	{
+		chunks.append(decoder->leaves);
+		_arena->absorb(decoder->arena);
+		failed |= decoder->failed;
+	}
+
+	qDeleteAll(decoders);
+
+	if (failed)
+	{
+		qDeleteAll(chunks);
+		chunks.clear();
+	}
+
+	build(chunks);
+	_tombstones = 0;
+
+	return !failed;
+}
+
+
+QDataStream& operator>>(QDataStream& in, SymbolSequence& seq)
+{
+	quint32 n, segmentSize, nSegments;
+	QVector<quint32> sizes;
+	QVector<quint32> counts;
+	qint64 total = 0;
+	qint64 symbols = 0;
+
+	seq.clear();		// (releases the arena before it is filled again)
+	in >> n >> segmentSize >> nSegments;
+
+	// (if the segment size is 0, the number of symbols of each segment is stored with its size)
+	if (in.status() != QDataStream::Ok || nSegments > n ||
+		(segmentSize > 0 && nSegments != (n + qint64(segmentSize) - 1) / segmentSize))
+	{
+		in.setStatus(QDataStream::ReadCorruptData);
+		return in;
+	}
+
+	// Read the table of the segment sizes, and then all the segments at once
+	sizes.resize(nSegments);
+	counts.resize(nSegments);
+	for (quint32 k = 0; k < nSegments && in.status() == QDataStream::Ok; k++)
+	{
+		in >> sizes[k];
+		if (segmentSize > 0)
+			counts[k] = k + 1 < nSegments ? segmentSize : n - k * segmentSize;
+		else in >> counts[k];
+
+		total += sizes[k];
+		symbols += counts[k];
+	}
+
+	if (in.status() != QDataStream::Ok || total > INT_MAX || symbols != n)
+	{
+		in.setStatus(QDataStream::ReadCorruptData);
+		return in;
+	}
+
+	QByteArray data(int(total), Qt::Uninitialized);
+	if (in.readRawData(data.data(), int(total)) != int(total))
+	{
+		in.setStatus(QDataStream::ReadPastEnd);
+		return in;
+	}
+
+	// The segments are slices of the data read at once
+	QVector<QByteArray> segments(nSegments);
+	const char* segment = data.constData();
+
+	for (quint32 k = 0; k < nSegments; segment += sizes[k], k++)
+		segments[k] = QByteArray::fromRawData(segment, int(sizes[k]));
+
+	if (!seq.decodeSegments(segments, counts, in.version(), in.byteOrder()))
+		in.setStatus(QDataStream::ReadCorruptData);
+
+	return in;
+}
+
+// Writes the spans of the symbols in the range (which must not contain tombstones)
+template<class It>
+static void writeSpans(QDataStream& out, It s, It end)
+{
+	while (s != end)
+	{
+		const Symbol& first = *s;
+		QString chars(first.getChar());
+		qint32 step = 0;
+
+		// Extend the span as long as the following symbols fit in it
+		for (s++; s != end && extendsSpan(first, *s, chars.size(), step); s++)
+			chars.append(s->getChar());
+
+		out << first.getPosition() << quint32(chars.size()) << step << chars << first.getFormatIndex();
+	}
+}
+
+QDataStream& operator<<(QDataStream& out, const SymbolSequence& seq)
+{
+	QVector<QByteArray> segments;
+	QVector<quint32> counts;
+
+	// Segments are made of whole chunks, so that the ones still encoded in their pages are copied as they are
+	// (the const chunks are only read, and they may be shared with the sequence of a live document)
+	for (const SymbolChunk& chunk : seq.chunks())
+	{
+		if (counts.isEmpty() || counts.last() + chunk.summary.count > SEQUENCE_SEGMENT_SIZE)
+		{
+			segments.append(QByteArray());
+			counts.append(0);
+		}
+
+		QByteArray bytes;
+		QDataStream chunkStream(&bytes, QIODevice::WriteOnly);
+		chunkStream.setVersion(out.version());
+		chunkStream.setByteOrder(out.byteOrder());
+
+		counts.last() += SymbolSequence::writeChunk(chunkStream, chunk).count;
+		segments.last().append(bytes);
+	}
+
+	// The table of the segment sizes (and their numbers of symbols) precedes their contents
+	out << quint32(seq.size()) << quint32(0) << quint32(segments.size());
+
+	for (int k = 0; k < segments.size(); k++)
+		out << quint32(segments[k].size()) << counts[k];
+
+	for (const QByteArray& segment : segments)
+		out.writeRawData(segment.constData(), segment.size());
+
+	return out;
+}
+
+
+const void* SymbolChunk::id() const
+{
+	return page.isNull() ? static_cast<const void*>(symbols.constData()) : page.constData();
+}
+
+PageSummary SymbolSequence::writeChunk(QDataStream& out, const SymbolChunk& chunk)
+{
+	if (!chunk.page.isNull())
+	{
+		// (pages are always encoded with the default settings of the stream)
+		QByteArray page = chunk.compressed ? qUncompress(chunk.page) : chunk.page;
+		out.writeRawData(page.constData(), page.size());
+		return chunk.summary;
+	}
+
+	QVector<Symbol> live;
+	PageSummary summary;
+
+	for (const Symbol& s : chunk.symbols)
+	{
+		if (!s.isDeleted())
+		{
+			live.append(s);
+			summary.levels += s.getPosition().size();
+			summary.depth = std::max(summary.depth, s.getPosition().size());
+		}
+	}
+
+	writeSpans(out, live.constBegin(), live.constEnd());
+
+	summary.count = quint32(live.size());
+	if (!live.isEmpty())
+		summary.head = live.first().getPosition();
+
+	return summary;
+}
+
+int SymbolSequence::pack()
+{
+	return pack(root);
+}
+
+int SymbolSequence::pack(Node* node)
+{
+	if (!node->isLeaf)
+	{
+		int packed = 0;
+		for (Node* child : node->children)
+			packed += pack(child);
+
+		return packed;
+	}
+
+	// (the leaves still encoded, the empty ones and the ones which hold tombstones are left as they are)
+	if (!node->page.isNull() || node->count == 0 || node->count != node->symbols.size())
+		return 0;
+
+	SymbolChunk chunk;
+	QByteArray page;
+	QDataStream out(&page, QIODevice::WriteOnly);
+
+	chunk.symbols = node->symbols;
+	PageSummary summary = writeChunk(out, chunk);
+
+	// The symbols of an encoded leaf are found by the tree search, through the position of the first one
+	for (const Symbol& s : node->symbols)
+		relocate(s.getPosition().fingerprint(), nullptr);
+
+	node->page = page;
+	node->compressed = false;
+	node->head = summary.head;
+	node->levels = summary.levels;
+	node->depth = summary.depth;
+	node->symbols = QVector<Symbol>();
+	node->chars = QVector<QChar>();
+	node->authors = QVector<qint32>();
+
+	return 1;
+}
+
+bool SymbolSequence::mapChunks(const QVector<SymbolChunk>& pages, QSharedPointer<QFile> file)
+{
+	QVector<Node*> leaves;
+	bool failed = false;
+
+	clear();
+
+	for (int k = 0; k < pages.size() && !failed; k++)
+	{
+		const PageSummary& summary = pages[k].summary;
+		Node* leaf = new Node(true);
+		leaf->count = int(summary.count);
+		leaves.append(leaf);
+
+		if (summary.count == 0 || summary.count > SEQUENCE_LEAF_SIZE)
+			failed = true;
+		else if (summary.depth > 0)
+		{
+			// The leaf is searched through its summary, its page is left as it is until the leaf is accessed
+			leaf->page = pages[k].page;
+			leaf->compressed = pages[k].compressed;
+			leaf->head = summary.head;
+			leaf->levels = summary.levels;
+			leaf->depth = summary.depth;
+		}
+		else
+		{
+			// Otherwise the page is scanned to check it, and to find the first position of the leaf
+			leaf->page = pages[k].compressed ? qUncompress(pages[k].page) : pages[k].page;
+			failed = !scanPage(leaf->page, summary.count, leaf->head, leaf->levels, leaf->depth);
+		}
+	}
+
+	if (failed)
+	{
+		qDeleteAll(leaves);
+		leaves.clear();
+	}
+	else _mapped = file;
+
+	build(leaves);
+	return !failed;
+}
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <QString>
+#include <QVector>
+#include <QHash>
+#include <QPair>
+#include <QSharedPointer>
+#include <QByteArray>
+#include <QDataStream>
+#include <QFile>
+
+#include <type_traits>
+
+#include "Symbol.h"
+
+#define SEQUENCE_LEAF_SIZE 256		// Maximum number of symbols stored in a leaf chunk of the tree
+#define SEQUENCE_NODE_SIZE 64		// Maximum number of children of an inner node of the tree
+#define SEQUENCE_SEGMENT_SIZE 4096	// Maximum number of symbols in each independently decodable segment of the serialized sequence
+#define SEQUENCE_PARALLEL_EDITS 64	// Minimum number of edits of a batch for each thread which applies it
+#define SEQUENCE_PARALLEL_SYMBOLS 65536	// Minimum number of symbols of a serialized sequence for each thread which decodes it
+
+
+/* Edit of a single symbol, located by its position, which can be applied to a sequence in a batch with others */
+struct SymbolEdit
+{
+	enum Type : qint32
+	{
+		Insertion,		// inserts the symbol (unless its position is already in the sequence)
+		Removal,		// marks the symbol with that position as a tombstone
+		Formatting		// sets the format index of the symbol with that position
+	};
+
+	Type type;
+	Symbol symbol;		// (only the position and the format index are used by removals and formattings)
+};
+
+
+/* What is known of the page of a chunk without decoding it, so that its leaf can be searched */
+struct PageSummary
+{
+	quint32 count = 0;		// (live symbols)
+	Position head;			// position of the first symbol
+	qint32 levels = 0;		// total and maximum number of levels of the positions (0 if the rest is unknown)
+	qint32 depth = 0;
+};
+
+
+/* Contents of a leaf of a sequence, as stored in a page: its symbols (shared with the leaf until either is modified),
+   or the page it was loaded from, if the leaf was never accessed since then */
+struct SymbolChunk
+{
+	QVector<Symbol> symbols;
+	QByteArray page;
+	bool compressed = false;	// (the page is a zlib stream, only inflated when the chunk is decoded)
+	PageSummary summary;		// (only the count, if the chunk is not a page)
+
+	const void* id() const;		// identifies the contents of the chunk, as long as it is kept
+};
+
+
+/* Ordered sequence of symbols, implemented as a counted B+ tree: the symbols are stored in
+   fixed-size chunks (leaves) and every node keeps the number of symbols in its subtree, so that
+   insertion, removal and access by index or by fractional position are all O(log n).
+   Symbols can also be removed lazily, as tombstones which stay in their chunk (and are skipped by
+   indexes, searches and iterators) until the sequence is purged.
+   The deep levels of the positions loaded from a stream are kept in an arena owned by the sequence.
+   The serialized sequence is split in segments preceded by a table of their sizes, which are decoded in parallel.
+   Leaves can also be loaded from pages of a file mapped in memory, and they are only decoded when first accessed.
+   The leaves of an idle sequence can be packed back into pages of spans, until they are accessed again.
+   Copies share the chunks of the original (copy-on-write) and only duplicate the nodes above them,
+   so that a frozen copy of a large sequence can be taken in a fraction of the time of a full one.
+   An optional hash index maps the fingerprint of each position to the chunk of its symbol, so
+   that symbols are located by position without comparisons along the path from the root
+   (the symbols missing from the index, such as the ones of the leaves still encoded, are searched in the tree).
+   A batch of edits is applied in parallel to the subtrees below the root (segments of disjoint position
+   ranges), each of which is only edited by one thread: the index changes are logged and applied at the end */
+
+class SymbolSequence
+{
+	/* Operators for QDataStream serialization and deserialization (symbols are written in spans,
+	   runs of symbols typed by the same author which only need their first position to be stored) */
+	friend QDataStream& operator>>(QDataStream& in, SymbolSequence& seq);			// Input
+	friend QDataStream& operator<<(QDataStream& out, const SymbolSequence& seq);	// Output
+
+	friend class SegmentDecoder;		// (decodes the serialized segments in parallel)
+	friend class SegmentEditor;			// (applies the edits of a batch to the segments in parallel)
+
+private:
+
+	struct Node
+	{
+		int count;					// number of (live) symbols in the subtree
+		bool isLeaf;
+		Node* parent;
+		QVector<Node*> children;	// (inner nodes only)
+		QVector<Symbol> symbols;	// (leaves only)
+
+		// Columns of the immutable fields of the symbols, kept parallel to the symbols of a leaf
+		// so that the scans which only need one field can be vectorized
+		QVector<QChar> chars;
+		QVector<qint32> authors;
+
+		// Encoded symbols of a leaf loaded from a page and never accessed since (its symbols and columns are empty
+		// until then), the position of its first symbol, for the searches which go past it, and the total and
+		// maximum number of levels of its positions
+		QByteArray page;
+		bool compressed;
+		Position head;
+		int levels;
+		int depth;
+
+		Node(bool leaf);
+		~Node();
+
+		Node* clone() const;
+
+		void insertSymbol(int index, const Symbol& s);
+		void removeSymbol(int index);
+		void refreshColumns();		// rebuilds the columns after the symbols were moved between leaves
+
+		// Translation between the indexes of the live symbols and the slots of a leaf (with tombstones)
+		int physicalIndex(int index) const;
+		int liveIndex(int slot) const;
+	};
+
+	Node* root;
+	int _tombstones;
+	QSharedPointer<PositionArena> _arena;		// deep levels of the positions read by deserialization (shared with the copies)
+	QSharedPointer<QFile> _mapped;				// file whose mapped pages the encoded leaves point into (shared with the copies)
+
+	bool _indexed;
+	QHash<quint64, Node*> _locations;		// position fingerprint -> leaf (only if indexed)
+
+public:
+
+	/* Forward iterator over the symbols of the sequence, which moves to the next chunk
+	   of the tree (with a lookup from the root) every SEQUENCE_LEAF_SIZE symbols.
+	   The const iterator never detaches the chunks shared with the copies of the sequence */
+	template<class T>
+	class Iterator
+	{
+		friend class SymbolSequence;
+
+	private:
+
+		typedef typename std::conditional<std::is_const<T>::value, const Node, Node>::type LeafNode;
+
+		const SymbolSequence* _seq;
+		LeafNode* _leaf;
+		int _index;			// absolute index in the sequence
+		int _offset;		// slot inside the current leaf
+
+		Iterator(const SymbolSequence* seq, int index);
+
+	public:
+
+		Iterator();
+
+		T& operator*() const;
+		T* operator->() const;
+
+		Iterator& operator++();
+		Iterator operator++(int);
+		Iterator operator+(int n) const;
+		Iterator operator-(int n) const;
+
+		int index() const;
+
+		bool operator==(const Iterator& other) const;
+		bool operator!=(const Iterator& other) const;
+		bool operator<(const Iterator& other) const;
+	};
+
+	typedef Iterator<Symbol> iterator;
+	typedef Iterator<const Symbol> const_iterator;
+
+
+	SymbolSequence();
+	SymbolSequence(const SymbolSequence& other);
+	~SymbolSequence();
+
+	SymbolSequence& operator=(const SymbolSequence& other);
+
+	/* Size */
+	int size() const;
+	bool isEmpty() const;
+	bool empty() const;
+
+	/* Element access (by index) */
+	const Symbol& operator[](int index) const;
+	const Symbol& first() const;
+	const Symbol& last() const;
+	Symbol& symbolAt(int index);		// (to modify the symbol, detaches its chunk if it is shared)
+
+	/* Search by fractional position */
+	int indexOf(const Position& pos) const;			// index of the symbol with that position, or -1
+	int lowerBound(const Position& pos) const;		// index of the first symbol with position >= pos
+
+	/* Scans on a single field of the symbols (vectorized) */
+	int indexOf(QChar c, int from = 0) const;		// index of the first symbol with that char (from the index on), or -1
+	int nextAuthorChange(int from, int to) const;	// index of the first symbol in (from, to) with another author, or to
+	QString text(int from, int count) const;		// chars of the symbols in the range
+
+	/* Editing */
+	void insert(int index, const Symbol& s);
+	void insert(int index, const QVector<Symbol>& run);		// (a run sorted by position, which all goes between index - 1 and index)
+	void removeAt(int index);
+	void removeRange(int from, int count);
+	void clear();
+	void squeeze();
+	void assign(const QVector<Symbol>& symbols);		// replaces the contents with a run of symbols sorted by position (tombstones included)
+
+	// Applies the edits in order (the ones in different segments on up to nThreads threads), returns the number of
+	// edits which changed the sequence (the others target positions already inserted, or not found)
+	int apply(const QVector<SymbolEdit>& edits, int nThreads = 1);
+
+	/* Hash index of the positions */
+	void setIndexed(bool enabled);
+	bool isIndexed() const;
+
+	/* Lazy removal */
+	void tombstone(int index);		// marks the symbol as deleted, without moving the following ones
+	void tombstone(int from, int count);
+	int tombstones() const;
+	void purge();					// reclaims the space of all the tombstones
+
+	/* Iterators */
+	iterator begin();
+	iterator end();
+	const_iterator begin() const;
+	const_iterator end() const;
+
+	QVector<Symbol> toVector(bool withTombstones = false) const;
+
+	/* Depth of the positions */
+	QPair<qint64, int> positionLevels() const;		// total and maximum number of levels (without decoding the encoded leaves)
+
+	/* Chunks (paged storage) */
+	QVector<SymbolChunk> chunks() const;		// (without decoding the leaves which are still encoded)
+	static PageSummary writeChunk(QDataStream& out, const SymbolChunk& chunk);		// (uncompressed) returns the summary of the page written
+	int pack();		// encodes the decoded leaves without tombstones into pages, returns the number of leaves packed
+
+	// Replaces the contents with a leaf for each page, which is only inflated and decoded when first accessed (the pages
+	// can point into the mapping of the file, which is then kept open), returns false if any page is corrupt.
+	// The pages without a summary are inflated and scanned right away
+	bool mapChunks(const QVector<SymbolChunk>& pages, QSharedPointer<QFile> file = QSharedPointer<QFile>());
+
+private:
+
+	Node* leafAt(int& index) const;		// finds the leaf containing the index and makes the index relative to it
+	static void expand(Node* leaf);		// decodes the page of a leaf into its symbols (if it is still encoded)
+	int pack(Node* node);
+	static void collectChunks(const Node* node, QVector<SymbolChunk>& chunks);
+	static void collectSymbols(Node* node, QVector<Symbol>& symbols);		// (tombstones included)
+	static void countLevels(const Node* node, qint64& total, int& max);
+	int offsetOf(const Node* node) const;		// index of the first symbol of the node (through the parents)
+
+	// Changes of the position index made while editing a subtree on another thread, to be applied
+	// once it has finished (a null leaf removes the fingerprint)
+	typedef QVector<QPair<quint64, Node*>> IndexLog;
+
+	Node* insertInto(Node* node, int index, const Symbol& s, IndexLog* log = nullptr);
+	QVector<Node*> insertRunInto(Node* node, int index, const QVector<Symbol>& run, int& next, const Position* limit);
+	static QVector<Node*> splitChildren(Node* node);		// (the nodes which follow it, if it overflows)
+	void markFrom(Node* node, int index, IndexLog* log = nullptr);
+	void markFrom(Node* node, int from, int count);
+	void removeFrom(Node* node, int index);
+	void removeFrom(Node* node, int from, int count);		// (frees the children inside the range, and trims the ones at its edges)
+	void forget(const Node* node);		// drops the symbols of a subtree which is deleted from the index, and its tombstones from the count
+	void rebalance(Node* node, int child);
+	static const Position& firstPosition(const Node* node);
+	static int childAt(const Node* node, const Position& pos);		// last child whose first symbol doesn't follow pos
+	static Node* searchLeaf(Node* node, const Position& pos, int& index);	// (index: live symbols before the leaf)
+
+	// Applies an edit to the subtree (among the siblings split from it) where its position belongs
+	bool edit(QVector<Node*>& subtrees, const SymbolEdit& e, IndexLog* log);
+
+	void locate(Node* leaf, int from = 0, IndexLog* log = nullptr);		// maps the symbols of the leaf (from the slot on) to it
+	void relocate(quint64 fingerprint, Node* leaf, IndexLog* log = nullptr);
+	void reindex(Node* node);
+
+	void build(QVector<Node*> leaves);		// builds the inner levels of the tree on top of a list of chunks
+	static Node* stack(QVector<Node*> level);		// groups the nodes under new inner nodes, up to a single root
+
+	// Decodes the spans of a serialized segment into new evenly filled chunks, returns false if the data is corrupt
+	// (the positions are copied in the heap if there is no arena)
+	static bool decodeSegment(QDataStream& in, quint32 n, QVector<Node*>& leaves, PositionArena* arena);
+
+	// Decodes the segments in parallel, and builds the tree on top of their chunks (or an empty one if any is corrupt)
+	bool decodeSegments(const QVector<QByteArray>& segments, const QVector<quint32>& counts, int version, QDataStream::ByteOrder byteOrder);
+};
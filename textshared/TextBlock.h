@@ -44,3 +44,4 @@ public:
 };
 
 Q_DECLARE_METATYPE(TextBlock);
+Q_DECLARE_TYPEINFO(TextBlock, Q_MOVABLE_TYPE);
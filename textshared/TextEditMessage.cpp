@@ -4,24 +4,24 @@
 /*************** CHARS INSERT MESSAGE ***************/
 
 CharsInsertMessage::CharsInsertMessage()
-	: Message(CharsInsert), m_flag(false)
+	: Message(CharsInsert), m_flag(false), m_epoch(0)
 {
 }
 
-CharsInsertMessage::CharsInsertMessage(QVector<Symbol> symbols, bool isLast, TextBlockID bId, QTextBlockFormat blkFmt)
-	: Message(CharsInsert), m_symbols(symbols), m_blockId(bId), m_blockFmt(blkFmt), m_flag(isLast)
+CharsInsertMessage::CharsInsertMessage(QVector<Symbol> symbols, QVector<QTextCharFormat> charFmts, bool isLast, TextBlockID bId, QTextBlockFormat blkFmt, quint32 epoch)
+	: Message(CharsInsert), m_symbols(symbols), m_charFmts(charFmts), m_blockId(bId), m_blockFmt(blkFmt), m_flag(isLast), m_epoch(epoch)
 {
 	m_symbols.squeeze();	// Avoid any unrequired memory usage to reduce message size
 }
 
 void CharsInsertMessage::writeTo(QDataStream& stream) const
 {
-	stream << m_symbols << m_blockId << m_blockFmt << m_flag;
+	stream << m_symbols << m_charFmts << m_blockId << m_blockFmt << m_flag << m_epoch;
 }
 
 void CharsInsertMessage::readFrom(QDataStream& stream)
 {
-	stream >> m_symbols >> m_blockId >> m_blockFmt >> m_flag;
+	stream >> m_symbols >> m_charFmts >> m_blockId >> m_blockFmt >> m_flag >> m_epoch;
 }
 
 QVector<Symbol> CharsInsertMessage::getSymbols() const
@@ -29,6 +29,11 @@ QVector<Symbol> CharsInsertMessage::getSymbols() const
 	return m_symbols;
 }
 
+QVector<QTextCharFormat> CharsInsertMessage::getCharFormats() const
+{
+	return m_charFmts;
+}
+
 TextBlockID CharsInsertMessage::getBlockId() const
 {
 	return m_blockId;
@@ -44,28 +49,33 @@ bool CharsInsertMessage::getIsLast() const
 	return m_flag;
 }
 
+quint32 CharsInsertMessage::getEpoch() const
+{
+	return m_epoch;
+}
+
 
 /*************** CHARS DELETE MESSAGE ***************/
 
 CharsDeleteMessage::CharsDeleteMessage()
-	: Message(CharsDelete)
+	: Message(CharsDelete), m_epoch(0)
 {
 }
 
-CharsDeleteMessage::CharsDeleteMessage(QVector<Position> positions)
-	: Message(CharsDelete), m_fPositions(positions)
+CharsDeleteMessage::CharsDeleteMessage(QVector<Position> positions, quint32 epoch)
+	: Message(CharsDelete), m_fPositions(positions), m_epoch(epoch)
 {
 	m_fPositions.squeeze();		// Avoid any extra memory usage to reduce message size
 }
 
 void CharsDeleteMessage::writeTo(QDataStream& stream) const
 {
-	stream << m_fPositions;
+	stream << m_fPositions << m_epoch;
 }
 
 void CharsDeleteMessage::readFrom(QDataStream& stream)
 {
-	stream >> m_fPositions;
+	stream >> m_fPositions >> m_epoch;
 }
 
 QVector<Position> CharsDeleteMessage::getPositions() const
@@ -73,27 +83,32 @@ QVector<Position> CharsDeleteMessage::getPositions() const
 	return m_fPositions;
 }
 
+quint32 CharsDeleteMessage::getEpoch() const
+{
+	return m_epoch;
+}
+
 
 /*************** CHAR FORMAT MESSAGE ***************/
 
 CharsFormatMessage::CharsFormatMessage()
-	: Message(CharsFormat)
+	: Message(CharsFormat), m_epoch(0)
 {
 }
 
-CharsFormatMessage::CharsFormatMessage(QVector<Position> positions, QVector<QTextCharFormat> fmts)
-	: Message(CharsFormat), m_fPos(positions), m_charFmt(fmts)
+CharsFormatMessage::CharsFormatMessage(QVector<Position> positions, QVector<QTextCharFormat> fmts, quint32 epoch)
+	: Message(CharsFormat), m_fPos(positions), m_charFmt(fmts), m_epoch(epoch)
 {
 }
 
 void CharsFormatMessage::writeTo(QDataStream& stream) const
 {
-	stream << m_fPos << m_charFmt;
+	stream << m_fPos << m_charFmt << m_epoch;
 }
 
 void CharsFormatMessage::readFrom(QDataStream& stream)
 {
-	stream >> m_fPos >> m_charFmt;
+	stream >> m_fPos >> m_charFmt >> m_epoch;
 }
 
 QVector<Position> CharsFormatMessage::getPositions() const
@@ -106,6 +121,11 @@ QVector<QTextCharFormat> CharsFormatMessage::getCharFormats() const
 	return m_charFmt;
 }
 
+quint32 CharsFormatMessage::getEpoch() const
+{
+	return m_epoch;
+}
+
 
 
 /*************** BLOCK FORMAT EDIT MESSAGE ***************/
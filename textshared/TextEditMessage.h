@@ -13,16 +13,18 @@ class CharsInsertMessage : public Message
 private:
 
 	QVector<Symbol> m_symbols;
+	QVector<QTextCharFormat> m_charFmts;		// formats referenced (by index) by the symbols
 	TextBlockID m_blockId;
 	QTextBlockFormat m_blockFmt;
 	bool m_flag;
+	quint32 m_epoch;		// epoch of the document to which the positions belong
 
 protected:
 
 	CharsInsertMessage();	// empty constructor
 
-	// Constructor for CharsInsert messages, carrying the list of symbols in a block and its format
-	CharsInsertMessage(QVector<Symbol> symbols, bool isLast, TextBlockID bId, QTextBlockFormat blkFmt);
+	// Constructor for CharsInsert messages, carrying the list of symbols in a block (with their formats) and its format
+	CharsInsertMessage(QVector<Symbol> symbols, QVector<QTextCharFormat> charFmts, bool isLast, TextBlockID bId, QTextBlockFormat blkFmt, quint32 epoch);
 
 	void writeTo(QDataStream& stream) const override;
 	void readFrom(QDataStream& stream) override;
@@ -32,9 +34,11 @@ public:
 	~CharsInsertMessage() {};
 
 	QVector<Symbol> getSymbols() const;
+	QVector<QTextCharFormat> getCharFormats() const;
 	TextBlockID getBlockId() const;
 	QTextBlockFormat getBlockFormat() const;
 	bool getIsLast() const;
+	quint32 getEpoch() const;
 }; 
 
 
@@ -45,13 +49,14 @@ class CharsDeleteMessage : public Message
 private:
 
 	QVector<Position> m_fPositions;
+	quint32 m_epoch;		// epoch of the document to which the positions belong
 
 protected:
 
 	CharsDeleteMessage();	// empty constructor
 
 	// Constructor for CharsDelete messages, with the fractional positions to delete
-	CharsDeleteMessage(QVector<Position> positions);
+	CharsDeleteMessage(QVector<Position> positions, quint32 epoch);
 
 	void writeTo(QDataStream& stream) const override;
 	void readFrom(QDataStream& stream) override;
@@ -61,6 +66,7 @@ public:
 	~CharsDeleteMessage() {};
 
 	QVector<Position> getPositions() const;
+	quint32 getEpoch() const;
 };
 
 
@@ -72,13 +78,14 @@ private:
 
 	QVector<Position> m_fPos;
 	QVector<QTextCharFormat> m_charFmt;
+	quint32 m_epoch;		// epoch of the document to which the positions belong
 
 protected:
 
 	CharsFormatMessage();	// empty constructor
 
 	// Constructor for CharsFormat messages, with the fractional positions and the new symbol formats
-	CharsFormatMessage(QVector<Position> positions, QVector<QTextCharFormat> fmts);
+	CharsFormatMessage(QVector<Position> positions, QVector<QTextCharFormat> fmts, quint32 epoch);
 
 	void writeTo(QDataStream& stream) const override;
 	void readFrom(QDataStream& stream) override;
@@ -89,6 +96,7 @@ public:
 
 	QVector<Position> getPositions() const;
 	QVector<QTextCharFormat> getCharFormats() const;
+	quint32 getEpoch() const;
 };
 
 
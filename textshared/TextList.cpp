@@ -20,14 +20,27 @@ TextList::TextList(TextListID listId, QTextListFormat fmt)
 }
 
 
-void TextList::addBlock(TextBlockID id)
+void TextList::addBlock(TextBlockID id, const Position& begin)
 {
-	_blocks.append(id);
+	_blocks.insert(begin, id);
 }
 
-void TextList::removeBlock(TextBlockID id)
+void TextList::removeBlock(TextBlockID id, const Position& begin)
 {
-	_blocks.removeAll(id);
+	QMap<Position, TextBlockID>::iterator i = _blocks.find(begin);
+	if (i != _blocks.end() && i.value() == id)
+		_blocks.erase(i);
+}
+
+void TextList::moveBlock(const Position& oldBegin, const Position& newBegin)
+{
+	QMap<Position, TextBlockID>::iterator i = _blocks.find(oldBegin);
+	if (i != _blocks.end())
+	{
+		TextBlockID id = i.value();
+		_blocks.erase(i);
+		_blocks.insert(newBegin, id);
+	}
 }
 
 void TextList::setFormat(QTextListFormat fmt)
@@ -48,8 +61,13 @@ QTextListFormat TextList::getFormat() const
 
 QList<TextBlockID> TextList::getBlocks() const
 {
-	// List of *unordered* blocks
-	return _blocks;
+	// List of the blocks, ordered by their position in the document
+	return _blocks.values();
+}
+
+TextBlockID TextList::getFirstBlock() const
+{
+	return _blocks.isEmpty() ? TextBlockID(nullptr) : _blocks.first();
 }
 
 bool TextList::isEmpty() const
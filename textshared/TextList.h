@@ -1,5 +1,6 @@
 #pragma once
 
+#include <QMap>
 #include <QTextListFormat>
 #include "TextUtils.h"
 
@@ -16,7 +17,7 @@ private:
 
 	TextListID _listId;
 	QTextListFormat _listFormat;
-	QList<TextBlockID> _blocks;
+	QMap<Position, TextBlockID> _blocks;		// blocks of the list, in document order (keyed by their begin position)
 
 public:
 
@@ -25,16 +26,19 @@ public:
 	TextList(qint32 listNum, qint32 authorId, QTextListFormat fmt);
 	TextList(TextListID listId, QTextListFormat fmt);
 
-	void addBlock(TextBlockID id);
-	void removeBlock(TextBlockID id);
+	void addBlock(TextBlockID id, const Position& begin);
+	void removeBlock(TextBlockID id, const Position& begin);
+	void moveBlock(const Position& oldBegin, const Position& newBegin);		// (when the begin of a block changes)
 	void setFormat(QTextListFormat fmt);
 
 	/* getters */
 	TextListID getId() const;
 	QTextListFormat getFormat() const;
 	QList<TextBlockID> getBlocks() const;
+	TextBlockID getFirstBlock() const;
 	bool isEmpty() const;
 
 };
 
 Q_DECLARE_METATYPE(TextList);
+Q_DECLARE_TYPEINFO(TextList, Q_MOVABLE_TYPE);
@@ -1,62 +1,318 @@
 #include "TextUtils.h"
 
 #include <QDataStream>
+#include <QtAlgorithms>
+
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define POSITION_SIMD_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define POSITION_SIMD_SSE2
+#endif
+
+
+/*************** POSITIONARENA CLASS ***************/
+
+PositionArena::PositionArena()
+	: _used(POSITION_ARENA_BLOCK)
+{
+}
+
+PositionArena::~PositionArena()
+{
+	clear();
+}
+
+
+qint32* PositionArena::allocate(int count)
+{
+	if (count > POSITION_ARENA_BLOCK)
+	{
+		// Oversized requests get a block of their own, kept before the one being filled
+		_blocks.prepend(new qint32[count]);
+		return _blocks.first();
+	}
+
+	if (_used + count > POSITION_ARENA_BLOCK)
+	{
+		_blocks.append(new qint32[POSITION_ARENA_BLOCK]);
+		_used = 0;
+	}
+
+	qint32* levels = _blocks.last() + _used;
+	_used += count;
+	return levels;
+}
+
+void PositionArena::absorb(PositionArena& other)
+{
+	// The blocks of the other arena are kept before the one being filled
+	for (qint32* block : other._blocks)
+		_blocks.prepend(block);
+
+	other._blocks.clear();
+	other._used = POSITION_ARENA_BLOCK;
+}
+
+void PositionArena::clear()
+{
+	for (qint32* block : _blocks)
+		delete[] block;
+
+	_blocks.clear();
+	_used = POSITION_ARENA_BLOCK;
+}
 
 
 /*************** POSITION CLASS ***************/
 
+#define KEY_SIGN_FLIP 0x80000000u		// maps signed levels to unsigned values with the same ordering
+
+
+// Lexicographic comparison of the deeper levels of two positions (up to n values)
+static int compareTail(const qint32* a, const qint32* b, int n)
+{
+	int i = 0;
+
+#if defined(POSITION_SIMD_AVX2)
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+		__m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+		quint32 mismatch = ~quint32(_mm256_movemask_epi8(_mm256_cmpeq_epi32(va, vb)));
+		if (mismatch)
+		{
+			i += qCountTrailingZeroBits(mismatch) / 4;
+			return a[i] < b[i] ? -1 : 1;
+		}
+	}
+#endif
+#if defined(POSITION_SIMD_AVX2) || defined(POSITION_SIMD_SSE2)
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+		__m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+		quint32 mismatch = ~quint32(_mm_movemask_epi8(_mm_cmpeq_epi32(va, vb))) & 0xFFFF;
+		if (mismatch)
+		{
+			i += qCountTrailingZeroBits(mismatch) / 4;
+			return a[i] < b[i] ? -1 : 1;
+		}
+	}
+#endif
+
+	// Scalar comparison of the remaining values
+	for (; i < n; i++)
+	{
+		if (a[i] != b[i])
+			return a[i] < b[i] ? -1 : 1;
+	}
+
+	return 0;
+}
+
+
 Position::Position()
-	: posIndexes({ -1, -1 })
+	: _key{ 0, 0 }, _size(0), _pooled(false), _tail(nullptr)
 {
+	setLevel(0, -1);
+	setLevel(1, -1);
+	_size = 2;
 }
 
 Position::Position(QVector<qint32> values)
-	: posIndexes(values)
+	: _pooled(false), _tail(nullptr)
 {
+	assign(values.constData(), values.size());
+}
+
+Position::Position(const Position& other)
+	: _pooled(false), _tail(nullptr)
+{
+	allocate(other._size);
+	_key[0] = other._key[0];
+	_key[1] = other._key[1];
+	if (_tail)
+		std::copy(other._tail, other._tail + _size - POSITION_KEY_LEVELS, _tail);
+}
+
+Position::Position(const Position& other, PositionArena& arena)
+	: _key{ other._key[0], other._key[1] }, _size(other._size), _pooled(false), _tail(nullptr)
+{
+	if (_size > POSITION_KEY_LEVELS)
+	{
+		_tail = arena.allocate(_size - POSITION_KEY_LEVELS);
+		_pooled = true;
+		std::copy(other._tail, other._tail + _size - POSITION_KEY_LEVELS, _tail);
+	}
+}
+
+Position::Position(Position&& other) noexcept
+	: _key{ other._key[0], other._key[1] }, _size(other._size), _pooled(other._pooled), _tail(other._tail)
+{
+	// Steal the buffer (if any) from the other position, which is left empty
+	other._size = 0;
+	other._pooled = false;
+	other._tail = nullptr;
+}
+
+Position::~Position()
+{
+	release();
+}
+
+Position& Position::operator=(const Position& other)
+{
+	if (this != &other)
+	{
+		release();
+		allocate(other._size);
+		_key[0] = other._key[0];
+		_key[1] = other._key[1];
+		if (_tail)
+			std::copy(other._tail, other._tail + _size - POSITION_KEY_LEVELS, _tail);
+	}
+
+	return *this;
+}
+
+Position& Position::operator=(Position&& other) noexcept
+{
+	if (this != &other)
+	{
+		release();
+		_key[0] = other._key[0];
+		_key[1] = other._key[1];
+		_size = other._size;
+		_pooled = other._pooled;
+		_tail = other._tail;
+		other._size = 0;
+		other._pooled = false;
+		other._tail = nullptr;
+	}
+
+	return *this;
+}
+
+
+void Position::assign(const qint32* values, qint32 size)
+{
+	allocate(size);
+	for (int i = 0; i < size; i++)
+		setLevel(i, values[i]);
+}
+
+void Position::allocate(qint32 size)
+{
+	_key[0] = _key[1] = 0;
+	_size = size;
+	_pooled = false;
+	_tail = size > POSITION_KEY_LEVELS ? new qint32[size - POSITION_KEY_LEVELS] : nullptr;
+}
+
+void Position::release()
+{
+	if (!_pooled)
+		delete[] _tail;
+
+	_tail = nullptr;
+	_pooled = false;
+	_size = 0;
+}
+
+void Position::setLevel(int index, qint32 value)
+{
+	if (index < POSITION_KEY_LEVELS)
+	{
+		// Levels are packed in big-endian order: the first level is in the high half of the first word
+		int shift = index % 2 ? 0 : 32;
+		quint64 level = quint64(quint32(value) ^ KEY_SIGN_FLIP) << shift;
+		_key[index / 2] = (_key[index / 2] & ~(Q_UINT64_C(0xFFFFFFFF) << shift)) | level;
+	}
+	else _tail[index - POSITION_KEY_LEVELS] = value;
 }
 
 
 qint32 Position::size() const
 {
-	return posIndexes.size();
+	return _size;
 }
 
 qint32 Position::operator[](int index) const
 {
-	return posIndexes.at(index);
+	Q_ASSERT(index >= 0 && index < _size);
+
+	if (index < POSITION_KEY_LEVELS)
+		return qint32(quint32(_key[index / 2] >> (index % 2 ? 0 : 32)) ^ KEY_SIGN_FLIP);
+	else return _tail[index - POSITION_KEY_LEVELS];
 }
 
 qint32 Position::getAuthorId() const
 {
 	// The last element in the fractional position vector is the User ID
-	return posIndexes.back();
+	return (*this)[_size - 1];
 }
 
 
-bool Position::operator==(const Position& other) const
+Position Position::shifted(int index, qint32 delta, PositionArena* arena) const
 {
-	return posIndexes == other.posIndexes;
+	Q_ASSERT(index >= 0 && index < _size);
+
+	Position result = arena ? Position(*this, *arena) : Position(*this);
+	result.setLevel(index, (*this)[index] + delta);
+	return result;
 }
 
-bool Position::operator<(const Position& other) const
+quint64 Position::fingerprint() const
 {
-	int minlen = this->posIndexes.size() < other.posIndexes.size() ?
-		this->posIndexes.size() : other.posIndexes.size();
+	// Multiply-xorshift mix of the packed key and of the deeper levels
+	const quint64 m = Q_UINT64_C(0x9E3779B97F4A7C15);
+	quint64 h = (_key[0] ^ quint64(_size)) * m;
+	h = (h ^ (h >> 29) ^ _key[1]) * m;
+
+	for (int i = 0; i < _size - POSITION_KEY_LEVELS; i++)
+		h = (h ^ (h >> 29) ^ quint32(_tail[i])) * m;
+
+	return h ^ (h >> 32);
+}
+
 
-	for (int i = 0; i < minlen; i++)
+int Position::compare(const Position& other) const
+{
+	// Compare the packed prefixes first (unused levels are zero, so a shorter prefix comes first)
+	if (_key[0] != other._key[0])
+		return _key[0] < other._key[0] ? -1 : 1;
+	if (_key[1] != other._key[1])
+		return _key[1] < other._key[1] ? -1 : 1;
+
+	// Same prefix: compare the levels which follow it
+	int minlen = std::min(_size, other._size) - POSITION_KEY_LEVELS;
+	if (minlen > 0)
 	{
-		if (this->posIndexes[i] < other.posIndexes[i])
-			return true;
-		else if (this->posIndexes[i] > other.posIndexes[i])
-			return false;
+		int result = compareTail(_tail, other._tail, minlen);
+		if (result)
+			return result;
 	}
 
-	return this->posIndexes.size() < other.posIndexes.size();
+	return _size == other._size ? 0 : (_size < other._size ? -1 : 1);
+}
+
+bool Position::operator==(const Position& other) const
+{
+	return compare(other) == 0;
+}
+
+bool Position::operator<(const Position& other) const
+{
+	return compare(other) < 0;
 }
 
 bool Position::operator>(const Position& other) const
 {
-	return !((*this) < other || (*this) == other);
+	return compare(other) > 0;
 }
 
 
@@ -73,28 +329,36 @@ TextElementID::TextElementID(qint32 num, qint32 uid)
 }
 
 
+quint64 TextElementID::key() const noexcept
+{
+	// The number is in the high half, so that it's compared before the author id
+	return (quint64(quint32(_number) ^ KEY_SIGN_FLIP) << 32) | (quint32(_authorId) ^ KEY_SIGN_FLIP);
+}
+
+qint32 TextElementID::getAuthorId() const
+{
+	return _authorId;
+}
+
+
 bool TextElementID::operator<(const TextElementID& other) const noexcept
 {
-	return this->_number < other._number ||
-		(this->_number == other._number && this->_authorId < other._authorId);
+	return key() < other.key();
 }
 
 bool TextElementID::operator>(const TextElementID& other) const noexcept
 {
-	return this->_number > other._number ||
-		(this->_number == other._number && this->_authorId > other._authorId);;
+	return key() > other.key();
 }
 
 bool TextElementID::operator==(const TextElementID& other) const noexcept
 {
-	return (this->_number == other._number &&
-		this->_authorId == other._authorId);
+	return key() == other.key();
 }
 
 bool TextElementID::operator!=(const TextElementID& other) const noexcept
 {
-	return (this->_number != other._number ||
-		this->_authorId != other._authorId);
+	return key() != other.key();
 }
 
 TextElementID::operator bool() const noexcept
@@ -125,11 +389,6 @@ qint32 TextBlockID::getBlockNumber() const
 	return _number;
 }
 
-qint32 TextBlockID::getAuthorId() const
-{
-	return _authorId;
-}
-
 
 // TextListID
 
@@ -153,19 +412,27 @@ qint32 TextListID::getListNumber() const
 	return _number;
 }
 
-qint32 TextListID::getAuthorId() const
-{
-	return _authorId;
-}
-
 
 /*************** SERIALIZATION OPERATORS ***************/
 
 
-// Position deserialization operator
+// Position deserialization operator (same layout as a QVector<qint32>)
 QDataStream& operator>>(QDataStream& in, Position& pos)
 {
-	in >> pos.posIndexes;
+	quint32 size;
+	in >> size;
+
+	pos.release();
+	if (in.status() != QDataStream::Ok)
+		return in;
+
+	pos.allocate(size);
+	for (quint32 i = 0; i < size; i++)
+	{
+		qint32 value;
+		in >> value;
+		pos.setLevel(i, value);
+	}
 
 	return in;
 }
@@ -173,7 +440,10 @@ QDataStream& operator>>(QDataStream& in, Position& pos)
 // Position serialization operator
 QDataStream& operator<<(QDataStream& out, const Position& pos)
 {
-	out << pos.posIndexes;
+	out << quint32(pos._size);
+
+	for (qint32 i = 0; i < pos._size; i++)
+		out << pos[i];
 
 	return out;
 }
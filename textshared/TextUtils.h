@@ -1,6 +1,36 @@
 #pragma once
 
 #include <QDataStream>
+#include <QVector>
+
+#include <type_traits>
+
+#define POSITION_KEY_LEVELS 4		// Number of fractional position levels packed in the comparison key
+#define POSITION_ARENA_BLOCK 16384	// Number of levels carved from each block of a PositionArena
+
+
+/* Bump allocator for the deep levels of the positions of a document, which are taken from a few
+   large blocks and only released all together (when the arena is cleared or destroyed) */
+
+class PositionArena
+{
+private:
+
+	QVector<qint32*> _blocks;
+	int _used;		// number of levels taken from the last block
+
+public:
+
+	PositionArena();
+	~PositionArena();
+
+	PositionArena(const PositionArena&) = delete;
+	PositionArena& operator=(const PositionArena&) = delete;
+
+	qint32* allocate(int count);
+	void absorb(PositionArena& other);		// takes over all the blocks of the other arena
+	void clear();
+};
 
 
 class Position
@@ -11,7 +41,17 @@ class Position
 
 private:
 
-	QVector<qint32> posIndexes;
+	// The first levels of the position are stored (sign-flipped, zero-padded) in a 128-bit key
+	// which preserves their ordering, so that most comparisons only need two integer compares
+	quint64 _key[2];
+	qint32 _size;
+	bool _pooled;		// the deeper levels belong to a PositionArena, and are never freed by the position
+	qint32* _tail;		// deeper levels (beyond POSITION_KEY_LEVELS) are stored in the heap (or in an arena)
+
+	void assign(const qint32* values, qint32 size);
+	void allocate(qint32 size);
+	void release();
+	void setLevel(int index, qint32 value);
 
 public:
 
@@ -19,11 +59,25 @@ public:
 
 	Position(QVector<qint32> values);
 
+	Position(const Position& other);
+	Position(const Position& other, PositionArena& arena);		// copy with the deeper levels in the arena
+	Position(Position&& other) noexcept;
+	~Position();
+
+	Position& operator=(const Position& other);
+	Position& operator=(Position&& other) noexcept;
+
 	/* getters */
 	qint32 size() const;
 	qint32 operator[](int index) const;
 	qint32 getAuthorId() const;
 
+	Position shifted(int index, qint32 delta, PositionArena* arena = nullptr) const;		// copy of the position with a level moved by delta
+	quint64 fingerprint() const;		// 64-bit hash of all the levels (equal positions have the same fingerprint)
+
+	/* three-way comparison, returns a negative, zero or positive value (this < other, ==, >) */
+	int compare(const Position& other) const;
+
 	/* comparison operators */
 	bool operator==(const Position& other) const;
 	bool operator<(const Position& other) const;
@@ -31,7 +85,11 @@ public:
 };
 
 Q_DECLARE_METATYPE(Position);
+Q_DECLARE_TYPEINFO(Position, Q_MOVABLE_TYPE);		// (no self-references, can be relocated with memmove)
+
 
+/* Pair of values identifying a block or a list, packed in 64 bits without any vtable
+   (the class can only be constructed through its derived types) */
 
 class TextElementID
 {
@@ -46,12 +104,14 @@ protected:
 
 	TextElementID();		// Empty constructor for deserialization purposes
 
-public:
-
 	// Construct a TextElementID with the specified pair of values
 	TextElementID(qint32 num, qint32 uid);
 
-	virtual qint32 getAuthorId() const = 0;		// To make the TextElemendID class abstract
+	quint64 key() const noexcept;		// both values packed in an integer with the same ordering
+
+public:
+
+	qint32 getAuthorId() const;
 
 	// Comparators to use this type as a key in QMap collections, or store in a QList
 	bool operator<(const TextElementID& other) const noexcept;
@@ -72,10 +132,12 @@ public:
 	TextBlockID(std::nullptr_t);				// Construct a null TextBlockID
 
 	qint32 getBlockNumber() const;
-	qint32 getAuthorId() const override;
 };
 
 Q_DECLARE_METATYPE(TextBlockID);
+Q_DECLARE_TYPEINFO(TextBlockID, Q_MOVABLE_TYPE);
+static_assert(std::is_trivially_copyable<TextBlockID>::value && sizeof(TextBlockID) == sizeof(quint64),
+	"TextBlockID must be a packed, trivially copyable 64-bit value");
 
 
 class TextListID : public TextElementID
@@ -88,7 +150,9 @@ public:
 	TextListID(std::nullptr_t);				// Construct a null TextListID
 
 	qint32 getListNumber() const;
-	qint32 getAuthorId() const override;
 };
 
 Q_DECLARE_METATYPE(TextListID);
+Q_DECLARE_TYPEINFO(TextListID, Q_MOVABLE_TYPE);
+static_assert(std::is_trivially_copyable<TextListID>::value && sizeof(TextListID) == sizeof(quint64),
+	"TextListID must be a packed, trivially copyable 64-bit value");